@@ -19,6 +19,7 @@
 #define SAVE_RECTS 1            // additionally save bounding rects of chunks (for visualization)
 #define TEST_SPEED 1000         // run a speed comparison between sequential & parallel
 #define MAX_ITER 999            // maximum number of iterations
+#define THINNING_LUT 1          // thin with the lookup tables instead of evaluating Zhang-Suen per pixel
 
 //================================
 // INCLUDES
@@ -313,6 +314,85 @@ void thinning_zs(){
   }while (diff);
 }
 
+// Lookup-table thinning: the 8 neighbours are packed into a code
+// (bit 0 = p2, north, then clockwise to bit 7 = p9, north-west) and
+// zs_lut[iter][code] tells whether sub-iteration iter deletes
+// the pixel. Tables were generated from the Zhang-Suen conditions above;
+// to try another rule, swap in its tables.
+const uchar zs_lut[2][256] = {
+  {
+    0,0,0,1,0,0,1,1,0,0,0,0,1,0,1,1,
+    0,0,0,0,0,0,0,0,1,0,0,0,1,0,1,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,1,0,0,0,1,0,1,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,
+    0,1,0,1,0,0,0,1,0,0,0,0,0,0,0,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,0,1,0,0,0,1,0,0,0,0,0,0,0,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,0,1,0,0,0,1,0,0,0,0,0,0,0,0,
+    1,1,0,1,0,0,0,0,1,1,0,0,0,0,0,0,
+  },
+  {
+    0,0,0,1,0,0,1,1,0,0,0,0,1,0,1,1,
+    0,0,0,0,0,0,0,0,1,0,0,0,1,0,1,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,1,0,0,0,1,0,1,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,1,0,0,0,1,0,1,0,
+    0,1,0,1,0,0,0,1,0,0,0,0,0,0,0,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,0,1,0,0,0,1,0,0,0,
+  },
+};
+
+int thinning_lut_iteration(const uchar* lut) {
+  int diff = 0;
+  for (int i = 1; i < H-1; i++){
+    for (int j = 1; j < W-1; j++){
+      uchar* up  = im+(i-1)*W+j;
+      uchar* mid = im+i*W+j;
+      uchar* dn  = im+(i+1)*W+j;
+      if (!(mid[0] & 1)){ // background needs no lookup
+        continue;
+      }
+      int c = (up[0]  & 1)     | (up[1]  & 1)<<1 | (mid[1] & 1)<<2 | (dn[1] & 1)<<3 |
+              (dn[0]  & 1)<<4  | (dn[-1] & 1)<<5 | (mid[-1]& 1)<<6 | (up[-1]& 1)<<7;
+      if (lut[c]){
+        mid[0] |= 2;
+      }
+    }
+  }
+  for (int i = 0; i < H*W; i++){
+    int marker = im[i]>>1;
+    int old = im[i]&1;
+    im[i] = old & (!marker);
+    if ((!diff) && (im[i] != old)){
+      diff = 1;
+    }
+  }
+  return diff;
+}
+void thinning_zs_lut(){
+  int diff = 1;
+  do {
+    diff &= thinning_lut_iteration(zs_lut[0]);
+    diff &= thinning_lut_iteration(zs_lut[1]);
+  }while (diff);
+}
+
 //================================
 // MAIN ALGORITHM
 //================================
@@ -772,7 +852,11 @@ int main(int argc, char** argv){
   #endif
 
   print_bitmap();
-  thinning_zs();
+  #if THINNING_LUT
+    thinning_zs_lut();
+  #else
+    thinning_zs();
+  #endif
   print_bitmap();
 
   polyline_t* p = NULL;
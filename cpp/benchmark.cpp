@@ -0,0 +1,599 @@
+// benchmark.cpp
+// Compare the raster thinning engines of trace_skeleton.cpp, and how
+// their output affects trace_skeleton() afterwards
+//
+// dependencies:
+// libpng
+// compile:
+// g++ benchmark.cpp -O3 -std=c++11 -pthread -lpng -o benchmark
+// use:
+// ./benchmark [-s scale] [-g n] [-p pad] [-n runs] [-t threads] [-j max] [-c] [-e name,...] [-k chunk] [-d dist] [-l size] [-b] [-w window] [-f] [-r divide|graph|auto] [-a count:pct|cover:pct] path/to/image.png ...
+//
+// -s upscales the image (nearest neighbour) to emulate large scans with thick strokes
+// -g repeats the image n x n times, like a page of many separate components
+// -p adds a blank margin of this many pixels around the image, like a small object in a camera frame
+// -n number of timed runs per engine, the best time is reported
+// -t threads for the multithreaded engines (default: one per core)
+// -j also time trace_skeleton() on 1, 2, 4, ... up to this many threads
+// -c trace each connected component separately (trace_components())
+// -e only run these engines (the first one, "byte", always runs as the reference)
+// -k chunk size of the tracer (T->params.chunk_size)
+// -d merge distance of the tracer (T->params.merge_dist)
+// -l largest simple leaf (T->params.simple_leaf_size), 0 = off
+// -b balanced seams (T->params.split_policy = SPLIT_BALANCED), used by parallel tracing only (-t, -j)
+// -w approximate seam search (T->params.seam_window), compared with the exact search:
+//    time, polylines, and broken joints (pairs of polyline ends within 2px of each other
+//    and of no other end, i.e. a stroke that was cut but not merged back)
+// -f trace with and without setting finished polylines aside (T->params.emit_finished),
+//    and check that the polylines are the same apart from their order
+// -r tracing engine (T->params.engine), and compare all three on the reference thinning:
+//    time, polylines, coverage, and the engine auto picked
+// -a autotune: instead of comparing engines, trace all the images with a range of chunk sizes
+//    and report the fastest one whose polyline count stays within pct percent of the -k setting
+//    (count:pct), or whose coverage of the skeleton pixels drops by at most pct points (cover:pct)
+
+#include <png.h>
+#include <time.h>
+#include "trace_skeleton.cpp"
+
+typedef unsigned char uchar;
+
+// use libpng to read png into array of 0s and 1s
+uchar* read_png_as_bitmap(const char* file_name, int* W, int* H){
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, file_name)){
+    return NULL;
+  }
+  image.format = PNG_FORMAT_GRAY;
+  uchar* buf = (uchar*)malloc(PNG_IMAGE_SIZE(image));
+  if (!png_image_finish_read(&image, NULL, buf, 0, NULL)){
+    free(buf);
+    return NULL;
+  }
+  *W = image.width;
+  *H = image.height;
+  for (int i = 0; i < (*W)*(*H); i++){
+    buf[i] = buf[i]>128?1:0;
+  }
+  return buf;
+}
+
+uchar* upscale(uchar* src, int W, int H, int s){
+  uchar* dst = (uchar*)malloc(W*s*H*s);
+  for (int i = 0; i < H*s; i++){
+    for (int j = 0; j < W*s; j++){
+      dst[i*W*s+j] = src[(i/s)*W+j/s];
+    }
+  }
+  return dst;
+}
+
+uchar* tile_image(uchar* src, int W, int H, int n){
+  uchar* dst = (uchar*)malloc(W*n*H*n);
+  for (int i = 0; i < H*n; i++){
+    for (int j = 0; j < W*n; j++){
+      dst[i*W*n+j] = src[(i%H)*W+j%W];
+    }
+  }
+  return dst;
+}
+
+uchar* pad_image(uchar* src, int W, int H, int p){
+  int w = W+p*2;
+  uchar* dst = (uchar*)calloc(w*(H+p*2),1);
+  for (int i = 0; i < H; i++){
+    memcpy(dst+(i+p)*w+p, src+i*W, W);
+  }
+  return dst;
+}
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+struct engine_t {
+  const char* name;
+  int mode;
+  int parallel; // use the -t thread count instead of 1
+  int exact;    // should match thinning_zs() bit for bit
+};
+
+engine_t engines[] = {
+  {"byte",      THINNING_BYTE,          0, 1},
+  {"byte-mt",   THINNING_BYTE,          1, 1},
+  {"bitpacked", THINNING_BITPACKED,     0, 1},
+  {"simd",      THINNING_SIMD,          0, 1},
+  {"lut",       THINNING_LUT,           0, 1},
+  {"worklist",  THINNING_WORKLIST,      0, 1},
+  {"dbuffer",   THINNING_DOUBLE_BUFFER, 0, 1},
+  {"tiled",     THINNING_TILED,         0, 1},
+  {"guo-hall",  THINNING_GUO_HALL,      0, 0},
+  {"holt",      THINNING_HOLT,          0, 0},
+  {"distance",  THINNING_DISTANCE,      0, 0},
+};
+
+// is name in the comma separated list?
+int selected(const char* list, const char* name){
+  int n = strlen(name);
+  const char* p = list;
+  while ((p = strstr(p, name))){
+    if ((p == list || p[-1] == ',') && (p[n] == ',' || p[n] == '\0')){
+      return 1;
+    }
+    p += n;
+  }
+  return 0;
+}
+
+int components = 0;
+
+// trace the thinned image once, the way trace() does
+skeleton_tracer_t::polyline_t* trace_once(skeleton_tracer_t* T){
+  if (components){
+    return T->trace_components();
+  }
+  skeleton_tracer_t::rect_t bb = {0,0,T->W,T->H,NULL};
+  #if TRACE_CROP
+    bb = T->rect_clip(T->rect_grow(T->foreground_bbox(),1));
+  #endif
+  return bb.w > 0 ? T->trace_region(bb.x,bb.y,bb.w,bb.h) : NULL;
+}
+
+// time trace_skeleton() on the thinned image, return best time and polyline count
+double time_trace(skeleton_tracer_t* T, int runs, int* count){
+  double best = 1e30;
+  for (int r = 0; r < runs; r++){
+    double t = now();
+    skeleton_tracer_t::polyline_t* p = trace_once(T);
+    t = now() - t;
+    if (t < best){
+      best = t;
+    }
+    *count = 0;
+    for (skeleton_tracer_t::polyline_t* it = p; it; it = it->next){
+      (*count)++;
+    }
+    T->destroy_polylines(p);
+    T->destroy_rects();
+  }
+  return best;
+}
+
+// number of skeleton pixels on or next to (8-neighbourhood) a traced polyline
+int covered_pixels(skeleton_tracer_t* T, skeleton_tracer_t::polyline_t* p){
+  int w = T->W, h = T->H;
+  uchar* on = (uchar*)calloc(w*h, 1);
+  for (skeleton_tracer_t::polyline_t* it = p; it; it = it->next){
+    on[it->head->y*w+it->head->x] = 1;
+    for (skeleton_tracer_t::point_t* a = it->head; a->next; a = a->next){
+      skeleton_tracer_t::point_t* b = a->next;
+      int n = std::max(abs(b->x-a->x),abs(b->y-a->y));
+      for (int k = 1; k <= n; k++){
+        int x = a->x+(int)floor((b->x-a->x)*(double)k/n+0.5);
+        int y = a->y+(int)floor((b->y-a->y)*(double)k/n+0.5);
+        on[y*w+x] = 1;
+      }
+    }
+  }
+  int c = 0;
+  for (int i = 0; i < h; i++){
+    for (int j = 0; j < w; j++){
+      if (!T->im[i*w+j]){
+        continue;
+      }
+      int hit = 0;
+      for (int di = -1; di <= 1 && !hit; di++){
+        for (int dj = -1; dj <= 1 && !hit; dj++){
+          int y = i+di, x = j+dj;
+          hit = x >= 0 && y >= 0 && x < w && y < h && on[y*w+x];
+        }
+      }
+      c += hit;
+    }
+  }
+  free(on);
+  return c;
+}
+
+// number of broken joints: pairs of polyline ends within 2px (either way) of each other and of no other end
+int broken_joints(skeleton_tracer_t::polyline_t* p){
+  size_t n = 0;
+  for (skeleton_tracer_t::polyline_t* it = p; it; it = it->next){
+    n += 2;
+  }
+  if (!n){
+    return 0;
+  }
+  int* e = (int*)malloc(sizeof(int)*2*n); // x,y of every end, sorted by y
+  size_t k = 0;
+  for (skeleton_tracer_t::polyline_t* it = p; it; it = it->next){
+    e[k++] = it->head->x; e[k++] = it->head->y;
+    e[k++] = it->tail->x; e[k++] = it->tail->y;
+  }
+  size_t* order = (size_t*)malloc(sizeof(size_t)*n);
+  for (size_t a = 0; a < n; a++){
+    order[a] = a;
+  }
+  std::sort(order, order+n, [e](size_t a, size_t b){ return e[a*2+1] < e[b*2+1]; });
+  int* near = (int*)calloc(n, sizeof(int)); // ends near each end
+  size_t* mate = (size_t*)malloc(sizeof(size_t)*n);
+  for (size_t a = 0; a < n; a++){
+    for (size_t b = a+1; b < n && e[order[b]*2+1]-e[order[a]*2+1] <= 2; b++){
+      if (abs(e[order[b]*2]-e[order[a]*2]) <= 2){
+        near[order[a]]++; mate[order[a]] = order[b];
+        near[order[b]]++; mate[order[b]] = order[a];
+      }
+    }
+  }
+  int c = 0;
+  for (size_t a = 0; a < n; a++){
+    c += near[a] == 1 && near[mate[a]] == 1 && mate[a] > a;
+  }
+  free(e);
+  free(order);
+  free(near);
+  free(mate);
+  return c;
+}
+
+// time and quality of the exact and the approximate seam search
+void compare_window(skeleton_tracer_t* T, int runs, int window){
+  int engine = T->params.engine;
+  T->params.engine = TRACE_DIVIDE; // the graph walk has no seams
+  for (int pass = 0; pass < 2; pass++){
+    T->params.seam_window = pass ? window : 0;
+    int count;
+    double t = time_trace(T, runs, &count);
+    skeleton_tracer_t::polyline_t* p = trace_once(T);
+    int broken = broken_joints(p);
+    T->destroy_polylines(p);
+    T->destroy_rects();
+    char name[32];
+    snprintf(name, sizeof(name), pass ? "window %d" : "exact seams", window);
+    printf("  %-12s trace %8.3f ms  %5d polylines  %4d broken joints\n", name, t*1000, count, broken);
+  }
+  T->params.seam_window = window;
+  T->params.engine = engine;
+}
+
+// the polylines as a sorted list of point sequences, each read from its smaller end
+std::vector<std::vector<int> > polyline_set(skeleton_tracer_t::polyline_t* p){
+  std::vector<std::vector<int> > set;
+  for (skeleton_tracer_t::polyline_t* it = p; it; it = it->next){
+    std::vector<int> a;
+    for (skeleton_tracer_t::point_t* q = it->head; q; q = q->next){
+      a.push_back(q->x);
+      a.push_back(q->y);
+    }
+    std::vector<int> b;
+    for (int k = (int)a.size()-2; k >= 0; k -= 2){
+      b.push_back(a[k]);
+      b.push_back(a[k+1]);
+    }
+    set.push_back(b < a ? b : a);
+  }
+  std::sort(set.begin(), set.end());
+  return set;
+}
+
+// time of tracing with and without emit_finished(), and whether the polylines are the same
+void compare_emit(skeleton_tracer_t* T, int runs){
+  int emit = T->params.emit_finished;
+  std::vector<std::vector<int> > sets[2];
+  for (int pass = 0; pass < 2; pass++){
+    T->params.emit_finished = pass;
+    int count;
+    double t = time_trace(T, runs, &count);
+    skeleton_tracer_t::polyline_t* p = trace_once(T);
+    sets[pass] = polyline_set(p);
+    T->destroy_polylines(p);
+    T->destroy_rects();
+    printf("  %-12s trace %8.3f ms  %5d polylines  %s\n", pass ? "emit" : "no emit", t*1000, count,
+      pass ? (sets[0] == sets[1] ? "identical" : "MISMATCH") : "-");
+  }
+  T->params.emit_finished = emit;
+}
+
+// time and quality of the tracing engines, and the choice of TRACE_AUTO
+void compare_engines(skeleton_tracer_t* T, int runs){
+  const char* names[] = {"divide","graph","auto"};
+  int engine = T->params.engine;
+  int white = 0;
+  for (int i = 0; i < T->W*T->H; i++){
+    white += T->im[i];
+  }
+  for (int e = TRACE_DIVIDE; e <= TRACE_AUTO; e++){
+    T->params.engine = e;
+    int count;
+    double t = time_trace(T, runs, &count);
+    skeleton_tracer_t::polyline_t* p = trace_once(T);
+    double cover = white ? covered_pixels(T, p)*100.0/white : 100.0;
+    T->destroy_polylines(p);
+    T->destroy_rects();
+    printf("  engine %-6s trace %8.3f ms  %5d polylines  %6.2f%% coverage", names[e], t*1000, count, cover);
+    if (e == TRACE_AUTO){
+      printf("  (picked %s)", names[T->last_engine]);
+    }
+    printf("\n");
+  }
+  T->params.engine = engine;
+}
+
+struct sample_t {
+  uchar* im; // thinned
+  int w, h;
+};
+
+// sweep chunk sizes over the samples, report the fastest one within tolerance
+void autotune(skeleton_tracer_t* T, sample_t* samples, int n, int runs, const char* tol){
+  int sizes[] = {4,6,8,10,12,14,16,20,24,32,48,64};
+  int ns = sizeof(sizes)/sizeof(sizes[0]);
+  int by_cover = !strncmp(tol,"cover",5);
+  const char* colon = strchr(tol,':');
+  double pct = colon ? atof(colon+1) : 0;
+  int base = T->params.chunk_size;
+  double t0 = 0, c0 = 0;
+  long long n0 = 0;
+  int best = -1;
+  double tbest = 1e30;
+  printf("autotune over %d images, %s within %g%s of chunk size %d\n",
+    n, by_cover ? "coverage" : "polyline count", pct, by_cover ? " points" : "%", base);
+  // the reference setting first, then the sweep
+  for (int s = -1; s < ns; s++){
+    if (s >= 0 && sizes[s] == base){
+      continue;
+    }
+    T->params.chunk_size = s < 0 ? base : sizes[s];
+    double t = 0;
+    long long count = 0, white = 0, covered = 0;
+    for (int k = 0; k < n; k++){
+      T->W = samples[k].w;
+      T->H = samples[k].h;
+      T->im = samples[k].im;
+      int c;
+      t += time_trace(T, runs, &c);
+      count += c;
+      skeleton_tracer_t::polyline_t* p = trace_once(T);
+      covered += covered_pixels(T, p);
+      T->destroy_polylines(p);
+      T->destroy_rects();
+      for (int i = 0; i < T->W*T->H; i++){
+        white += T->im[i];
+      }
+    }
+    double cover = white ? covered*100.0/white : 100.0;
+    if (s < 0){
+      t0 = t;
+      n0 = count;
+      c0 = cover;
+    }
+    int ok = by_cover ? cover >= c0-pct : fabs((double)(count-n0)) <= n0*pct/100;
+    if (ok && t < tbest){
+      tbest = t;
+      best = T->params.chunk_size;
+    }
+    printf("  chunk %3d  trace %8.3f ms  %6.2fx  %7lld polylines  %6.2f%% coverage  %s\n",
+      T->params.chunk_size, t*1000, t0/t, count, cover, ok ? "ok" : "out of tolerance");
+  }
+  printf("  fastest: chunk size %d, %.3f ms (%.2fx)\n", best, tbest*1000, t0/tbest);
+  T->params.chunk_size = base;
+  T->im = NULL;
+}
+
+int main(int argc, char** argv){
+  int scale = 1;
+  int pad = 0;
+  int grid = 1;
+  int runs = 5;
+  int threads = 0;
+  int trace_threads = 0;
+  const char* only = NULL;
+  const char* tune = NULL;
+  int window = 0;
+  int engines_cmp = 0;
+  int emit_cmp = 0;
+  sample_t* samples = (sample_t*)malloc(sizeof(sample_t)*argc);
+  int nsamples = 0;
+  skeleton_tracer_t* T = new skeleton_tracer_t();
+
+  for (int a = 1; a < argc; a++){
+    if (!strcmp(argv[a],"-s") && a+1 < argc){
+      scale = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-g") && a+1 < argc){
+      grid = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-p") && a+1 < argc){
+      pad = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-n") && a+1 < argc){
+      runs = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-t") && a+1 < argc){
+      threads = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-j") && a+1 < argc){
+      trace_threads = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-c")){
+      components = 1;
+      continue;
+    }
+    if (!strcmp(argv[a],"-e") && a+1 < argc){
+      only = argv[++a];
+      continue;
+    }
+    if (!strcmp(argv[a],"-k") && a+1 < argc){
+      T->params.chunk_size = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-d") && a+1 < argc){
+      T->params.merge_dist = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-l") && a+1 < argc){
+      T->params.simple_leaf_size = atoi(argv[++a]);
+      continue;
+    }
+    if (!strcmp(argv[a],"-w") && a+1 < argc){
+      window = atoi(argv[++a]);
+      T->params.seam_window = window;
+      continue;
+    }
+    if (!strcmp(argv[a],"-r") && a+1 < argc){
+      a++;
+      T->params.engine = !strcmp(argv[a],"graph") ? TRACE_GRAPH : !strcmp(argv[a],"auto") ? TRACE_AUTO : TRACE_DIVIDE;
+      engines_cmp = 1;
+      continue;
+    }
+    if (!strcmp(argv[a],"-f")){
+      emit_cmp = 1;
+      continue;
+    }
+    if (!strcmp(argv[a],"-b")){
+      T->params.split_policy = SPLIT_BALANCED;
+      continue;
+    }
+    if (!strcmp(argv[a],"-a") && a+1 < argc){
+      tune = argv[++a];
+      continue;
+    }
+    int w, h;
+    uchar* src = read_png_as_bitmap(argv[a], &w, &h);
+    if (!src){
+      printf("Error reading %s\n", argv[a]);
+      continue;
+    }
+    if (scale > 1){
+      uchar* big = upscale(src, w, h, scale);
+      free(src);
+      src = big;
+      w *= scale;
+      h *= scale;
+    }
+    if (grid > 1){
+      uchar* big = tile_image(src, w, h, grid);
+      free(src);
+      src = big;
+      w *= grid;
+      h *= grid;
+    }
+    if (pad > 0){
+      uchar* big = pad_image(src, w, h, pad);
+      free(src);
+      src = big;
+      w += pad*2;
+      h += pad*2;
+    }
+    printf("%s (%dx%d)\n", argv[a], w, h);
+    T->W = w;
+    T->H = h;
+    if (tune){ // just thin it, and keep it for autotune()
+      T->im = src;
+      T->num_threads = threads;
+      T->thinning();
+      sample_t sm = {src, w, h};
+      samples[nsamples++] = sm;
+      T->im = NULL;
+      continue;
+    }
+
+    uchar* ref = NULL;
+    double tref = 0;
+    int n = sizeof(engines)/sizeof(engines[0]);
+    for (int e = 0; e < n; e++){
+      if (e > 0 && only && !selected(only, engines[e].name)){
+        continue;
+      }
+      double best = 1e30;
+      for (int r = 0; r < runs; r++){
+        T->im = (uchar*)malloc(w*h);
+        memcpy(T->im, src, w*h);
+        T->thinning_mode = engines[e].mode;
+        T->num_threads = engines[e].parallel ? threads : 1;
+        double t = now();
+        T->thinning();
+        t = now() - t;
+        if (t < best){
+          best = t;
+        }
+        if (r < runs-1){
+          free(T->im);
+        }
+      }
+      int count;
+      double ttrace = time_trace(T, runs, &count);
+      const char* check = "-";
+      if (!ref){
+        ref = T->im;
+        tref = best;
+      }else{
+        if (engines[e].exact){
+          check = memcmp(ref, T->im, w*h) ? "MISMATCH" : "identical";
+        }
+        free(T->im);
+      }
+      printf("  %-12s %10.3f ms  %6.2fx  %4d passes  trace %8.3f ms  %5d polylines  %s\n",
+        engines[e].name, best*1000, tref/best, T->thinning_iterations, ttrace*1000, count, check);
+    }
+    if (trace_threads > 0){
+      T->im = ref;
+      double t1 = 0;
+      int nt0 = T->num_threads;
+      for (int nt = 1; nt <= trace_threads; nt *= 2){
+        int count;
+        T->num_threads = nt;
+        double t = time_trace(T, runs, &count);
+        if (nt == 1){
+          t1 = t;
+        }
+        printf("  trace %2d threads %8.3f ms  %6.2fx  %5d polylines\n", nt, t*1000, t1/t, count);
+      }
+      T->num_threads = nt0;
+    }
+    if (window > 0){
+      T->im = ref;
+      compare_window(T, runs, window);
+    }
+    if (emit_cmp){
+      T->im = ref;
+      compare_emit(T, runs);
+    }
+    if (engines_cmp){
+      T->im = ref;
+      compare_engines(T, runs);
+    }
+    if (components){
+      printf("  %d components\n", T->num_components);
+    }
+  #if LEAF_CACHE
+    long long lookups, hits;
+    T->leaf_cache_stats(&lookups, &hits);
+    printf("  leaf cache %lld lookups  %.1f%% hits (all images so far)\n", lookups, lookups ? hits*100.0/lookups : 0.0);
+  #endif
+    free(ref);
+    free(src);
+    T->im = NULL;
+  }
+  if (tune && nsamples){
+    T->num_threads = threads;
+    autotune(T, samples, nsamples, runs, tune);
+  }
+  for (int k = 0; k < nsamples; k++){
+    free(samples[k].im);
+  }
+  free(samples);
+  T->destroy();
+  delete T;
+  return 0;
+}
@@ -9,8 +9,29 @@
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <stdint.h>
 #include <string>
 #include <climits>
+#include <algorithm>
+
+#if !defined(__EMSCRIPTEN__)
+  #define USE_THREADS 1         // parallel stages use std::thread (compile with -pthread)
+  #include <thread>
+  #include <mutex>
+  #include <condition_variable>
+  #include <atomic>
+  #include <vector>
+  #include <deque>
+#else
+  #define USE_THREADS 0
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__EMSCRIPTEN__)
+  #define THINNING_X86 1        // build the SSE2/AVX2 thinning kernels
+  #include <immintrin.h>
+#else
+  #define THINNING_X86 0
+#endif
 
 //================================
 // ENUMS
@@ -18,13 +39,61 @@
 #define HORIZONTAL 1
 #define VERTICAL 2
 
+#define THINNING_BYTE 0         // Zhang-Suen on the byte image, one pixel at a time
+#define THINNING_BITPACKED 1    // Zhang-Suen on a 1-bit-per-pixel copy, 64 pixels at a time
+#define THINNING_SIMD 2         // Zhang-Suen on the byte image, 16/32 pixels at a time (SSE2/AVX2)
+#define THINNING_LUT 3          // Zhang-Suen via 256-entry lookup tables of 8-neighbour codes
+#define THINNING_WORKLIST 4     // Zhang-Suen visiting only pixels near the previous deletions
+#define THINNING_DOUBLE_BUFFER 5 // Zhang-Suen in one sweep per sub-iteration, ping-ponging two buffers
+#define THINNING_GUO_HALL 6     // Guo-Hall (not Zhang-Suen): thinner diagonals
+#define THINNING_HOLT 7         // Holt et al. (not Zhang-Suen): one sub-iteration per iteration
+#define THINNING_TILED 8        // Zhang-Suen, several iterations per cache-sized tile before moving on
+#define THINNING_DISTANCE 9     // peel pixels in distance transform order (not Zhang-Suen): O(pixels)
+
+#define SPLIT_CENTER 0          // of the best seams, split_chunk() takes the one nearest the middle of the chunk
+#define SPLIT_BALANCED 1        // ... the one leaving the most even foreground on both sides (parallel tasks only)
+
+#define TRACE_DIVIDE 0          // trace by dividing the image into chunks and merging their fragments (trace_skeleton())
+#define TRACE_GRAPH 1           // trace by walking the pixel graph from ends and junctions (trace_graph())
+#define TRACE_AUTO 2            // pick one of the above per image (choose_engine())
+
 //================================
 // PARAMS
 //================================
 #define CHUNK_SIZE 10           // the chunk size
 #define SAVE_RECTS 1            // additionally save bounding rects of chunks (for visualization)
 #define MAX_ITER 999            // maximum number of iterations
+#define MERGE_DIST 4            // fragment ends across a seam are joined if less than this apart along it
+#define SPLIT_POLICY SPLIT_CENTER // how split_chunk() breaks ties between seams, SPLIT_CENTER or SPLIT_BALANCED
+#define SEAM_WINDOW 0           // split_chunk() only scores seams this close to the middle (unless none is valid), 0 = all
+#define TRACE_ENGINE TRACE_DIVIDE // tracing engine used by trace(), TRACE_DIVIDE, TRACE_GRAPH or TRACE_AUTO
+#define TRACE_AUTO_MAX_DENSITY 40 // TRACE_AUTO takes TRACE_GRAPH if less than this percentage of pixels are white
+#define TRACE_AUTO_MAX_JUNCTIONS 30 // ... and less than this percentage of the white pixels are junctions
+#define TRACE_AUTO_SAMPLE_ROWS 256 // rows choose_engine() looks at
+#define SIMPLE_LEAF_SIZE 0      // larger chunks up to this size (at most 64) holding one straight stroke are leaves too, 0 = off (see simple_chunk())
+#define THINNING_MODE THINNING_BITPACKED // default raster thinning engine used by trace()
+#define NUM_THREADS 1           // worker threads for parallel stages, 1 = serial, 0 = one per core
+#define PARALLEL_MIN_PIXELS 262144 // thinning_zs() runs serially below this image size
+#define THINNING_TILE_SIZE 256  // tile side for THINNING_TILED, tile + halo should fit in L2
+#define THINNING_TILE_ROUNDS 4  // Zhang-Suen iterations per tile visit
+#define PARALLEL_TRACE_MIN_PIXELS 16384 // trace_skeleton_parallel() stops spawning tasks below this chunk area
+#define TRACE_ITERATIVE 1       // trace() uses trace_skeleton_iterative(), which has no MAX_ITER depth cap
+#define MERGE_INDEX_MIN 8       // merge_frags() indexes the first chunk's endpoints from this many fragments on
+#define TRACE_EMIT_FINISHED 0   // set polylines that can't merge any more aside during tracing (changes their output order), see params.emit_finished
+#define TRACE_COMPONENTS 0      // trace() traces each 8-connected component on its own (see trace_components())
+#define TRACE_CROP 0            // trace() starts from the foreground bounding box instead of the whole image (changes the rects and seams)
+#define LEAF_BITS 1             // chunk_to_frags() works on bitmasks for chunks of up to 16x16 (see chunk_to_frags_bits())
+#define LEAF_CACHE 0            // memoize chunk_to_frags() by the content of the leaf (see leaf_cache_t)
+#define LEAF_CACHE_SLOTS 4096   // leaves the cache holds at most
 
+// expand a deletion rule over all 256 neighbour codes, for building lookup tables
+#define THINNING_LUT_4(f,c,it)   f((c),it),f((c)+1,it),f((c)+2,it),f((c)+3,it)
+#define THINNING_LUT_16(f,c,it)  THINNING_LUT_4(f,c,it), THINNING_LUT_4(f,(c)+4,it),\
+                                 THINNING_LUT_4(f,(c)+8,it), THINNING_LUT_4(f,(c)+12,it)
+#define THINNING_LUT_64(f,c,it)  THINNING_LUT_16(f,c,it), THINNING_LUT_16(f,(c)+16,it),\
+                                 THINNING_LUT_16(f,(c)+32,it),THINNING_LUT_16(f,(c)+48,it)
+#define THINNING_LUT_256(f,it)   THINNING_LUT_64(f,0,it),  THINNING_LUT_64(f,64,it),\
+                                 THINNING_LUT_64(f,128,it),THINNING_LUT_64(f,192,it)
 
 struct skeleton_tracer_t {
   //================================
@@ -34,9 +103,57 @@ struct skeleton_tracer_t {
   uchar* im; // the image
   int W;     // width
   int H;     // height
+  int thinning_mode; // one of the THINNING_* engines
+  int num_threads;   // worker threads for parallel stages, 0 = one per core
+  int thinning_iterations; // passes (sub-iterations) taken by the last thinning call
+  int num_components;      // components traced by the last trace_components() call
+  int last_engine;         // TRACE_DIVIDE or TRACE_GRAPH, as picked by the last trace_region() call
+  typedef struct _trace_params_t {
+    int chunk_size; // chunks no larger than this (both ways) are not split any more
+    int max_iter;   // depth limit of the recursive trace_skeleton()
+    int merge_dist; // fragment ends across a seam are joined if less than this apart along it
+    int simple_leaf_size; // chunks up to this size (at most 64) are not split if simple_chunk()
+    int split_policy; // SPLIT_CENTER or SPLIT_BALANCED
+    int seam_window;  // approximate seam search: score seams up to this far from the middle, 0 = exact
+    int engine;       // TRACE_DIVIDE, TRACE_GRAPH or TRACE_AUTO
+    int emit_finished; // set polylines that can't merge any more aside during tracing (iterative and parallel tracers)
+  } trace_params_t;
+  trace_params_t params; // tracing parameters, from the PARAMS of the same names by default
+  struct {
+    uint64_t* rows; // the region packed by rows, nw words each; NULL outside trace_skeleton_root()
+    uint64_t* cols; // and by columns, nh words each
+    int* rsum;      // white pixels of a row before each of its words (nw+1 per row)
+    int* csum;      // same for the columns (nh+1 per column)
+    uchar* b8;      // 1 where an 8x8 block has white pixels
+    uchar* b64;     // same per 64x64 block
+    int x, y;       // origin of the region (in pixels)
+    int w8, nw, nh; // 8x8 blocks per row, 64-bit words (and 64x64 blocks) per row and per column
+  } occ;            // occupancy tables of the region being traced
+  struct leaf_cache_t;
+  leaf_cache_t* leaf_cache; // leaves seen so far (LEAF_CACHE), kept until destroy()
 
   skeleton_tracer_t(){
     im = NULL;
+    thinning_mode = THINNING_MODE;
+    num_threads = NUM_THREADS;
+    thinning_iterations = 0;
+    num_components = 0;
+    last_engine = TRACE_DIVIDE;
+    params.chunk_size = CHUNK_SIZE;
+    params.max_iter = MAX_ITER;
+    params.merge_dist = MERGE_DIST;
+    params.simple_leaf_size = SIMPLE_LEAF_SIZE;
+    params.split_policy = SPLIT_POLICY;
+    params.seam_window = SEAM_WINDOW;
+    params.engine = TRACE_ENGINE;
+    params.emit_finished = TRACE_EMIT_FINISHED;
+    occ.rows = NULL;
+    occ.cols = NULL;
+    occ.rsum = NULL;
+    occ.csum = NULL;
+    occ.b8 = NULL;
+    occ.b64 = NULL;
+    leaf_cache = NULL;
     rects.head = NULL;
     rects.tail = NULL;
   }
@@ -45,10 +162,15 @@ struct skeleton_tracer_t {
   // DATASTRUCTURES
   //================================
 
+  // While tracing, next and prev are just the two neighbours of a point,
+  // in either order, so that a polyline can be reversed by swapping its head
+  // and tail; normalize_polylines() makes next point towards the tail again
+  // before the polylines are handed out.
   typedef struct _point_t {
     int x;
     int y;
     struct _point_t * next;
+    struct _point_t * prev;
   } point_t;
 
   typedef struct _polyline_t {
@@ -59,6 +181,14 @@ struct skeleton_tracer_t {
     int size;
   } polyline_t;
 
+  // list of polylines that knows its last element and length, so that
+  // whole lists can be spliced in O(1)
+  typedef struct _frag_list_t {
+    polyline_t* head;
+    polyline_t* tail;
+    int size;
+  } frag_list_t;
+
 
   typedef struct _rect_t {
     int x;
@@ -86,15 +216,32 @@ struct skeleton_tracer_t {
     q0->size = 0;
     return q0;
   }
+  // the neighbour of point p that isn't q (q = NULL at an end of the polyline)
+  static point_t* step_point(point_t* p, point_t* q){
+    return p->next == q ? p->prev : p->next;
+  }
+
+  // hook point q onto the free neighbour slot of end point p
+  static void link_point(point_t* p, point_t* q){
+    if (!p->next){
+      p->next = q;
+    }else{
+      p->prev = q;
+    }
+  }
+
   std::string print_polyline(polyline_t* q){
     std::string str = "";
     if (!q){
       return str;
     }
     point_t* jt = q->head;
+    point_t* kt = NULL;
     while(jt){
       str += std::to_string(jt->x)+","+std::to_string(jt->y)+" ";
-      jt = jt->next;
+      point_t* lt = step_point(jt,kt);
+      kt = jt;
+      jt = lt;
     }
     return str;
   }
@@ -105,11 +252,7 @@ struct skeleton_tracer_t {
     }
     polyline_t* it = q;
     while(it){
-      point_t* jt = it->head;
-      while(jt){
-        str += std::to_string(jt->x)+","+std::to_string(jt->y)+" ";
-        jt = jt->next;
-      }
+      str += print_polyline(it);
       str += "\n";
       it = it->next;
     }
@@ -123,34 +266,31 @@ struct skeleton_tracer_t {
     while(it){
       polyline_t* lt = it->next;
       point_t* jt = it->head;
+      point_t* kt = NULL;
       while(jt){
-        point_t* kt = jt->next;
-        free(jt);
-        jt = kt;
+        point_t* lt = step_point(jt,kt);
+        if (kt){
+          free(kt);
+        }
+        kt = jt;
+        jt = lt;
+      }
+      if (kt){
+        free(kt);
       }
       free(it);
       it = lt;
     }
   }
 
+  // O(1): the points don't store a direction (see point_t)
   void reverse_polyline(polyline_t* q){
-    if (!q || (q->size < 2)){
+    if (!q){
       return;
     }
-    q->tail->next = q->head;
-    point_t* it0 = q->head;
-    point_t* it1 = it0->next;
-    point_t* it2 = it1->next;
-    int i; for (i = 0; i < q->size-1; i++){
-        it1->next = it0;
-        it0 = it1;
-        it1 = it2;
-        it2 = it2->next;
-    }
     point_t* q_head = q->head;
     q->head = q->tail;
     q->tail = q_head;
-    q->tail->next = NULL;
   }
 
   void cat_tail_polyline(polyline_t* q0, polyline_t* q1){
@@ -165,10 +305,10 @@ struct skeleton_tracer_t {
       q0->tail = q1->tail;
       return;
     }
-    q0->tail->next = q1->head;
+    link_point(q0->tail,q1->head);
+    link_point(q1->head,q0->tail);
     q0->tail = q1->tail;
     q0->size += q1->size;
-    q0->tail->next = NULL;
   }
 
   void cat_head_polyline(polyline_t* q0, polyline_t* q1){
@@ -186,10 +326,10 @@ struct skeleton_tracer_t {
       q0->tail = q1->tail;
       return;
     }
-    q1->tail->next = q0->head;
+    link_point(q1->tail,q0->head);
+    link_point(q0->head,q1->tail);
     q0->head = q1->head;
     q0->size += q1->size;
-    q0->tail->next = NULL;
   }
 
   void add_point_to_polyline(polyline_t* q, int x, int y){
@@ -197,16 +337,33 @@ struct skeleton_tracer_t {
     p->x = x;
     p->y = y;
     p->next = NULL;
+    p->prev = NULL;
     if (!q->head){
       q->head = p;
       q->tail = p;
     }else{
-      q->tail->next = p;
+      link_point(q->tail,p);
+      p->prev = q->tail;
       q->tail = p;
     }
     q->size++;
   }
 
+  // make next point from head to tail in every polyline again, O(points)
+  void normalize_polylines(polyline_t* q){
+    for (polyline_t* it = q; it; it = it->next){
+      point_t* jt = it->head;
+      point_t* kt = NULL;
+      while(jt){
+        point_t* lt = step_point(jt,kt);
+        jt->prev = kt;
+        jt->next = lt;
+        kt = jt;
+        jt = lt;
+      }
+    }
+  }
+
   polyline_t* prepend_polyline(polyline_t* q0, polyline_t* q1){
     if (!q0){
       return q1;
@@ -216,6 +373,64 @@ struct skeleton_tracer_t {
     return q1;
   }
 
+  // walk a list of polylines once to find its tail and length
+  frag_list_t frag_list(polyline_t* q){
+    frag_list_t l = {q,q,0};
+    for (polyline_t* it = q; it; it = it->next){
+      l.tail = it;
+      l.size++;
+    }
+    return l;
+  }
+
+  // put q in front of list l
+  void push_frag(frag_list_t* l, polyline_t* q){
+    q->prev = NULL;
+    q->next = l->head;
+    if (l->head){
+      l->head->prev = q;
+    }else{
+      l->tail = q;
+    }
+    l->head = q;
+    l->size++;
+  }
+
+  // take q out of list l
+  void remove_frag(frag_list_t* l, polyline_t* q){
+    if (q->prev){
+      q->prev->next = q->next;
+    }else{
+      l->head = q->next;
+    }
+    if (q->next){
+      q->next->prev = q->prev;
+    }else{
+      l->tail = q->prev;
+    }
+    q->prev = NULL;
+    q->next = NULL;
+    l->size--;
+  }
+
+  // append list l1 to list l0 in O(1), leaving l1 empty
+  void cat_frags(frag_list_t* l0, frag_list_t* l1){
+    if (!l1->head){
+      return;
+    }
+    if (!l0->head){
+      *l0 = *l1;
+    }else{
+      l0->tail->next = l1->head;
+      l1->head->prev = l0->tail;
+      l0->tail = l1->tail;
+      l0->size += l1->size;
+    }
+    l1->head = NULL;
+    l1->tail = NULL;
+    l1->size = 0;
+  }
+
   std::string print_rects(){
     std::string str;
     rect_t* it = rects.head;
@@ -237,7 +452,51 @@ struct skeleton_tracer_t {
     rects.tail = NULL;
   }
 
+  // smallest rect containing both, empty rects (w or h <= 0) are ignored
+  static rect_t rect_union(rect_t a, rect_t b){
+    if (a.w <= 0 || a.h <= 0){
+      return b;
+    }
+    if (b.w <= 0 || b.h <= 0){
+      return a;
+    }
+    rect_t r = a;
+    r.x = std::min(a.x,b.x);
+    r.y = std::min(a.y,b.y);
+    r.w = std::max(a.x+a.w,b.x+b.w)-r.x;
+    r.h = std::max(a.y+a.h,b.y+b.h)-r.y;
+    return r;
+  }
+
+  // rect grown by d pixels on every side, empty rects stay empty
+  static rect_t rect_grow(rect_t a, int d){
+    if (a.w <= 0 || a.h <= 0){
+      return a;
+    }
+    a.x -= d;
+    a.y -= d;
+    a.w += d*2;
+    a.h += d*2;
+    return a;
+  }
+
+  // rect clipped to the image
+  rect_t rect_clip(rect_t a){
+    int x1 = std::min(a.x+a.w,W);
+    int y1 = std::min(a.y+a.h,H);
+    a.x = std::max(a.x,0);
+    a.y = std::max(a.y,0);
+    a.w = std::max(x1-a.x,0);
+    a.h = std::max(y1-a.y,0);
+    return a;
+  }
+
   void add_rect(int x, int y, int w, int h){
+    add_rect_to(&rects,x,y,w,h);
+  }
+
+  // same as add_rect(), into another list
+  static void add_rect_to(_rects_t* rs, int x, int y, int w, int h){
     #if SAVE_RECTS
       rect_t* r = (rect_t*)malloc(sizeof(rect_t));
       r->x = x;
@@ -245,47 +504,89 @@ struct skeleton_tracer_t {
       r->w = w;
       r->h = h;
       r->next = NULL;
-      if (!rects.head){
-        rects.head = r;
-        rects.tail = r;
+      if (!rs->head){
+        rs->head = r;
+        rs->tail = r;
       }else{
-        rects.tail->next = r;
-        rects.tail = r;
+        rs->tail->next = r;
+        rs->tail = r;
       }
     #endif
   }
 
+  // move the rects of rs1 to the end of rs0
+  static void cat_rects(_rects_t* rs0, _rects_t* rs1){
+    if (!rs1->head){
+      return;
+    }
+    if (!rs0->head){
+      rs0->head = rs1->head;
+    }else{
+      rs0->tail->next = rs1->head;
+    }
+    rs0->tail = rs1->tail;
+    rs1->head = NULL;
+    rs1->tail = NULL;
+  }
+
   //================================
   // RASTER SKELETONIZATION
   //================================
   // Binary image thinning (skeletonization) in-place.
   // Implements Zhang-Suen algorithm.
   // http://agcggs680.pbworks.com/f/Zhan-Suen_algorithm.pdf
-  bool thinning_zs_iteration(int iter) {
-    bool diff = false;
-    for (int i = 1; i < H-1; i++){
-      for (int j = 1; j < W-1; j++){
-        int p2 = im[(i-1)*W+j]   & 1;
-        int p3 = im[(i-1)*W+j+1] & 1;
-        int p4 = im[(i)*W+j+1]   & 1;
-        int p5 = im[(i+1)*W+j+1] & 1;
-        int p6 = im[(i+1)*W+j]   & 1;
-        int p7 = im[(i+1)*W+j-1] & 1;
-        int p8 = im[(i)*W+j-1]   & 1;
-        int p9 = im[(i-1)*W+j-1] & 1;
-        
-        int A  = (p2 == 0 && p3 == 1) + (p3 == 0 && p4 == 1) +
-          (p4 == 0 && p5 == 1) + (p5 == 0 && p6 == 1) +
-          (p6 == 0 && p7 == 1) + (p7 == 0 && p8 == 1) +
-          (p8 == 0 && p9 == 1) + (p9 == 0 && p2 == 1);
-        int B  = p2 + p3 + p4 + p5 + p6 + p7 + p8 + p9;
-        int m1 = iter == 0 ? (p2 * p4 * p6) : (p2 * p4 * p8);
-        int m2 = iter == 0 ? (p4 * p6 * p8) : (p2 * p6 * p8);
-        if (A == 1 && (B >= 2 && B <= 6) && m1 == 0 && m2 == 0)
-          im[i*W+j] |= 2;
+  // whether Zhang-Suen sub-iteration `iter` deletes pixel (i,j) (reads bit 0 only)
+  inline bool thinning_zs_deletes(int i, int j, int iter){
+    int p2 = im[(i-1)*W+j]   & 1;
+    int p3 = im[(i-1)*W+j+1] & 1;
+    int p4 = im[(i)*W+j+1]   & 1;
+    int p5 = im[(i+1)*W+j+1] & 1;
+    int p6 = im[(i+1)*W+j]   & 1;
+    int p7 = im[(i+1)*W+j-1] & 1;
+    int p8 = im[(i)*W+j-1]   & 1;
+    int p9 = im[(i-1)*W+j-1] & 1;
+    
+    int A  = (p2 == 0 && p3 == 1) + (p3 == 0 && p4 == 1) +
+      (p4 == 0 && p5 == 1) + (p5 == 0 && p6 == 1) +
+      (p6 == 0 && p7 == 1) + (p7 == 0 && p8 == 1) +
+      (p8 == 0 && p9 == 1) + (p9 == 0 && p2 == 1);
+    int B  = p2 + p3 + p4 + p5 + p6 + p7 + p8 + p9;
+    int m1 = iter == 0 ? (p2 * p4 * p6) : (p2 * p4 * p8);
+    int m2 = iter == 0 ? (p4 * p6 * p8) : (p2 * p6 * p8);
+    return A == 1 && (B >= 2 && B <= 6) && m1 == 0 && m2 == 0;
+  }
+  // mark pixel (i,j) with bit 1 if Zhang-Suen sub-iteration `iter` deletes it
+  inline void thinning_zs_mark(int i, int j, int iter){
+    if (thinning_zs_deletes(i,j,iter))
+      im[i*W+j] |= 2;
+  }
+
+  // bounding box of the foreground, w = h = 0 if there is none
+  rect_t foreground_bbox(){
+    rect_t r = {0,0,0,0,NULL};
+    int x0 = W, y0 = H, x1 = -1, y1 = -1;
+    for (int i = 0; i < H; i++){
+      for (int j = 0; j < W; j++){
+        if (im[i*W+j]){
+          x0 = std::min(x0,j);
+          x1 = std::max(x1,j);
+          y0 = std::min(y0,i);
+          y1 = i;
+        }
       }
     }
-    for (int i = 0; i < H*W; i++){
+    if (x1 >= 0){
+      r.x = x0;
+      r.y = y0;
+      r.w = x1-x0+1;
+      r.h = y1-y0+1;
+    }
+    return r;
+  }
+  // delete marked pixels in im[i0..i1), return whether anything changed
+  inline bool thinning_zs_unmark(int i0, int i1){
+    bool diff = false;
+    for (int i = i0; i < i1; i++){
       int marker = im[i]>>1;
       int old = im[i]&1;
       im[i] = old & (!marker);
@@ -294,152 +595,1540 @@ struct skeleton_tracer_t {
       }
     }
     return diff;
+  }
+  bool thinning_zs_iteration(int iter) {
+    for (int i = 1; i < H-1; i++){
+      for (int j = 1; j < W-1; j++){
+        thinning_zs_mark(i,j,iter);
+      }
+    }
+    return thinning_zs_unmark(0,H*W);
   };
+
+  // Active window: a pixel whose neighbourhood hasn't changed since the last
+  // sub-iteration of the same kind gets the same answer, so sub-iteration n
+  // only needs to scan the box around what changed in sub-iterations n-1
+  // and n-2 (grown by 1). The first two scan the foreground bounding box.
+
+  /**thinning_zs_iteration() restricted to a window
+   * @param iter sub-iteration, 0 or 1
+   * @param win  pixels to scan
+   * @param chg  receives the bounding box of the deleted pixels
+   * @return     whether any pixel was deleted
+   */
+  bool thinning_zs_window_iteration(int iter, rect_t win, rect_t* chg){
+    int i0 = std::max(win.y,1);
+    int j0 = std::max(win.x,1);
+    int i1 = std::min(win.y+win.h,H-1);
+    int j1 = std::min(win.x+win.w,W-1);
+    int x0 = W, y0 = H, x1 = -1, y1 = -1;
+    for (int i = i0; i < i1; i++){
+      for (int j = j0; j < j1; j++){
+        thinning_zs_mark(i,j,iter);
+      }
+    }
+    for (int i = i0; i < i1; i++){
+      for (int j = j0; j < j1; j++){
+        if (im[i*W+j] == 3){
+          x0 = std::min(x0,j);
+          x1 = std::max(x1,j);
+          y0 = std::min(y0,i);
+          y1 = i;
+        }
+        im[i*W+j] = im[i*W+j] == 1;
+      }
+    }
+    rect_t r = {x0,y0,x1-x0+1,y1-y0+1,NULL};
+    if (x1 < 0){
+      r.w = r.h = 0;
+    }
+    *chg = r;
+    return x1 >= 0;
+  }
   void thinning_zs(){
+  #if USE_THREADS
+    int nt = thread_count();
+    if (nt > 1 && W*H >= PARALLEL_MIN_PIXELS && H-2 >= nt){
+      thinning_zs_parallel(nt);
+      return;
+    }
+  #endif
     bool diff = true;
+    rect_t c1 = foreground_bbox(); // changes in the previous sub-iteration,
+    rect_t c2 = c1;                // and the one before
+    thinning_iterations = 0;
     do {
-      diff &= thinning_zs_iteration(0);
-      diff &= thinning_zs_iteration(1);
+      thinning_iterations += 2;
+      for (int iter = 0; iter < 2; iter++){
+        rect_t chg;
+        diff &= thinning_zs_window_iteration(iter,rect_grow(rect_union(c1,c2),1),&chg);
+        c2 = c1;
+        c1 = chg;
+      }
     }while (diff);
   }
 
-  //================================
-  // MAIN ALGORITHM
-  //================================
+  // number of worker threads to use for parallel stages
+  int thread_count(){
+  #if USE_THREADS
+    if (num_threads > 0){
+      return num_threads;
+    }
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  #else
+    return 1;
+  #endif
+  }
 
-  // check if a region has any white pixel
-  int not_empty(int x, int y, int w, int h){
-    for (int i = y; i < y+h; i++){
-      for (int j = x; j < x+w; j++){
-        if (im[i*W+j]){
-          return 1;
+#if USE_THREADS
+  // reusable barrier for a fixed number of threads
+  struct barrier_t {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int n;
+    int count;
+    int gen;
+    barrier_t(int n): n(n), count(0), gen(0) {}
+    void wait(){
+      std::unique_lock<std::mutex> lock(mtx);
+      int g = gen;
+      if (++count == n){
+        count = 0;
+        gen++;
+        cv.notify_all();
+      }else{
+        cv.wait(lock, [&]{ return gen != g; });
+      }
+    }
+  };
+
+  // Band-parallel Zhang-Suen: the rows are split into nt horizontal bands.
+  // The mark pass reads the rows above and below a band (its halo), so the
+  // marks go to a separate buffer instead of bit 1 of the image: while
+  // marking the image is only read, while deleting only the marks are.
+  // Each sub-iteration is: mark own rows, barrier, delete own pixels,
+  // barrier. Threads agree on convergence through shared flags, one set
+  // per round parity so a flag is never reset while another thread reads it.
+  // The result is identical to the serial version.
+  void thinning_zs_parallel(int nt){
+    barrier_t bar(nt);
+    uchar* mark = (uchar*)calloc(W*H, 1);
+    std::atomic<bool> changed[2][2];
+    for (int r = 0; r < 2; r++){
+      changed[r][0] = false;
+      changed[r][1] = false;
+    }
+    auto work = [&](int t){
+      int i0 = 1 + (H-2)*t/nt;
+      int i1 = 1 + (H-2)*(t+1)/nt;
+      int k0 = (int)((long long)H*W*t/nt);
+      int k1 = (int)((long long)H*W*(t+1)/nt);
+      for (int round = 0; ; round++){
+        std::atomic<bool>* ch = changed[round&1];
+        for (int iter = 0; iter < 2; iter++){
+          for (int i = i0; i < i1; i++){
+            for (int j = 1; j < W-1; j++){
+              mark[i*W+j] = thinning_zs_deletes(i,j,iter);
+            }
+          }
+          bar.wait();
+          bool diff = false;
+          for (int k = k0; k < k1; k++){
+            int old = im[k]&1;
+            im[k] = old & !mark[k];
+            diff |= im[k] != old;
+          }
+          if (diff){
+            ch[iter] = true;
+          }
+          bar.wait();
+        }
+        bool diff = ch[0] && ch[1];
+        if (t == 0){
+          thinning_iterations = (round+1)*2;
+          changed[(round+1)&1][0] = false;
+          changed[(round+1)&1][1] = false;
+        }
+        if (!diff){
+          break;
         }
       }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < nt; t++){
+      pool.push_back(std::thread(work, t));
     }
-    return 0;
+    work(0);
+    for (int t = 0; t < (int)pool.size(); t++){
+      pool[t].join();
+    }
+    free(mark);
   }
+#endif
 
-  /**merge ith fragment of second chunk to first chunk
-   * @param c0   fragments from  first  chunk
-   * @param c1i  ith fragment of second chunk
-   * @param sx   (x or y) coordinate of the seam
-   * @param isv  is vertical, not horizontal?
-   * @param mode 2-bit flag, 
-   *             MSB = is matching the left (not right) end of the fragment from first  chunk
-   *             LSB = is matching the right (not left) end of the fragment from second chunk
-   * @return     matching successful?             
+  // Bit-packed Zhang-Suen: same result as thinning_zs() on a 0/1 image,
+  // but each row is stored as 64-bit words and the A/B/m1/m2 conditions
+  // are evaluated for 64 pixels at once with shifts and boolean logic.
+  // Bit b of word k in a row is the pixel at column 64*k+b.
+
+  // set bits where at least two of the 8 inputs are set
+  static uint64_t bits_at_least_2(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+                                  uint64_t e, uint64_t f, uint64_t g, uint64_t h){
+    uint64_t one = 0, two = 0;
+    two |= one & a; one |= a;
+    two |= one & b; one |= b;
+    two |= one & c; one |= c;
+    two |= one & d; one |= d;
+    two |= one & e; one |= e;
+    two |= one & f; one |= f;
+    two |= one & g; one |= g;
+    two |= one & h;
+    return two;
+  }
+  // set bits where exactly one of the 8 inputs is set
+  static uint64_t bits_exactly_1(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+                                 uint64_t e, uint64_t f, uint64_t g, uint64_t h){
+    uint64_t one = a|b|c|d|e|f|g|h;
+    return one & ~bits_at_least_2(a,b,c,d,e,f,g,h);
+  }
+
+  /**one Zhang-Suen sub-iteration on the packed bitmap
+   * @param bm    packed image, H rows of nw words
+   * @param nw    number of words per row
+   * @param mask  per-word mask of the columns that may be deleted (1..W-2)
+   * @param buf   scratch space for 2 rows
+   * @param iter  sub-iteration, 0 or 1
+   * @param win   pixels to scan, see thinning_zs_window_iteration()
+   * @param chg   receives the bounding box of the deleted pixels, in whole words
+   * @return      whether any pixel was deleted
    */
-  int merge_impl(polyline_t* c0, polyline_t* c1i, int sx, int isv, int mode){
-    int b0 = (mode >> 1 & 1)>0; // match c0 left
-    int b1 = (mode >> 0 & 1)>0; // match c1 left
-    polyline_t* c0j = NULL;
-    int md = 4; // maximum offset to be regarded as continuous
+  bool thinning_zs_bits_iteration(uint64_t* bm, int nw, uint64_t* mask, uint64_t* buf, int iter,
+                                  rect_t win, rect_t* chg){
+    bool diff = false;
+    uint64_t* up = buf;     // row above, before this sub-iteration
+    uint64_t* sv = buf+nw;  // current row, before this sub-iteration
+    chg->w = chg->h = 0;
+    win = rect_clip(win);
+    int i0 = std::max(win.y,1);
+    int i1 = std::min(win.y+win.h,H-1);
+    if (i0 >= i1 || win.w <= 0){
+      return diff;
+    }
+    int k0 = win.x>>6;               // words to scan
+    int k1 = (win.x+win.w+63)>>6;
+    int c0 = std::max(k0-1,0);       // words to read
+    int c1 = std::min(k1+1,nw);
+    int kmin = nw, kmax = -1, imin = H, imax = -1;
+    memcpy(up+c0, bm+(i0-1)*nw+c0, (c1-c0)*sizeof(uint64_t));
+    for (int i = i0; i < i1; i++){
+      uint64_t* mid = bm+i*nw;
+      uint64_t* dn  = bm+(i+1)*nw;
+      memcpy(sv+c0, mid+c0, (c1-c0)*sizeof(uint64_t));
+      for (int k = k0; k < k1; k++){
+        bool nx = k+1 < nw; // carry in from the next word, if there is one
+        uint64_t p2 = up[k];
+        uint64_t p3 = (up[k]>>1)  | (nx ? (up[k+1]<<63)  : 0);
+        uint64_t p4 = (sv[k]>>1)  | (nx ? (sv[k+1]<<63)  : 0);
+        uint64_t p5 = (dn[k]>>1)  | (nx ? (dn[k+1]<<63)  : 0);
+        uint64_t p6 = dn[k];
+        uint64_t p7 = (dn[k]<<1)  | (k ? (dn[k-1]>>63) : 0);
+        uint64_t p8 = (sv[k]<<1)  | (k ? (sv[k-1]>>63) : 0);
+        uint64_t p9 = (up[k]<<1)  | (k ? (up[k-1]>>63) : 0);
 
-    point_t* p1 = b1 ? c1i->head : c1i->tail;
+        uint64_t A1 = bits_exactly_1(~p2&p3, ~p3&p4, ~p4&p5, ~p5&p6,
+                                     ~p6&p7, ~p7&p8, ~p8&p9, ~p9&p2);
+        uint64_t B26 = bits_at_least_2( p2, p3, p4, p5, p6, p7, p8, p9)
+                     & bits_at_least_2(~p2,~p3,~p4,~p5,~p6,~p7,~p8,~p9);
+        uint64_t m = iter == 0 ? ~(p2&p4&p6) & ~(p4&p6&p8)
+                               : ~(p2&p4&p8) & ~(p2&p6&p8);
+        uint64_t del = sv[k] & mask[k] & A1 & B26 & m;
+        if (del){
+          mid[k] &= ~del;
+          diff = true;
+          kmin = std::min(kmin,k);
+          kmax = std::max(kmax,k);
+          imin = std::min(imin,i);
+          imax = i;
+        }
+      }
+      uint64_t* tmp = up; up = sv; sv = tmp;
+    }
+    if (diff){
+      chg->x = kmin*64;
+      chg->y = imin;
+      chg->w = (kmax-kmin+1)*64;
+      chg->h = imax-imin+1;
+    }
+    return diff;
+  }
 
-    if (abs((isv?(p1->y):(p1->x))-sx)>0){ // not on the seam, skip
-      return 0;
+  void thinning_zs_bits(){
+    if (W <= 0 || H <= 0){
+      return;
     }
-    // find the best match
-    polyline_t* it = c0;
-    while (it){
-      point_t* p0 = b0?(it->head):(it->tail);
-      if (abs((isv?(p0->y):(p0->x))-sx)>1){ // not on the seam, skip
-        it = it->next;
-        continue;
+    int nw = (W+63)/64;
+    uint64_t* bm   = (uint64_t*)calloc(nw*H, sizeof(uint64_t));
+    uint64_t* mask = (uint64_t*)calloc(nw,   sizeof(uint64_t));
+    uint64_t* buf  = (uint64_t*)calloc(nw*2, sizeof(uint64_t));
+    for (int j = 1; j < W-1; j++){
+      mask[j>>6] |= (uint64_t)1 << (j&63);
+    }
+    for (int i = 0; i < H; i++){
+      for (int j = 0; j < W; j++){
+        bm[i*nw+(j>>6)] |= (uint64_t)(im[i*W+j] & 1) << (j&63);
       }
-      int d = abs((isv?(p0->x):(p0->y)) - (isv?(p1->x):(p1->y)));
-      if (d < md){
-        c0j = it;
-        md = d;
+    }
+    bool diff = true;
+    rect_t c1 = foreground_bbox(); // see thinning_zs_window_iteration()
+    rect_t c2 = c1;
+    thinning_iterations = 0;
+    do {
+      thinning_iterations += 2;
+      for (int iter = 0; iter < 2; iter++){
+        rect_t chg;
+        diff &= thinning_zs_bits_iteration(bm,nw,mask,buf,iter,rect_grow(rect_union(c1,c2),1),&chg);
+        c2 = c1;
+        c1 = chg;
+      }
+    }while (diff);
+    for (int i = 0; i < H; i++){
+      for (int j = 0; j < W; j++){
+        im[i*W+j] = (bm[i*nw+(j>>6)] >> (j&63)) & 1;
       }
-      it = it->next;
     }
+    free(bm);
+    free(mask);
+    free(buf);
+  }
 
-    if (c0j){ // best match is good enough, merge them
-      if (b0 && b1){
-        reverse_polyline(c1i);
-        cat_head_polyline(c0j,c1i);
-      }else if (!b0 && b1){
-        cat_tail_polyline(c0j,c1i);
-      }else if (b0 && !b1){
-        cat_head_polyline(c0j,c1i);
-      }else {
-        reverse_polyline(c1i);
-        cat_tail_polyline(c0j,c1i);
+  // SIMD Zhang-Suen: same two passes as thinning_zs_iteration(), but the
+  // neighbour loads, A/B/m1/m2 tests and the unmark pass are done on 16 (SSE2)
+  // or 32 (AVX2) pixels per instruction. Columns that don't fill a whole
+  // vector fall back to the scalar code. The kernel is picked at runtime.
+#if THINNING_X86
+  __attribute__((target("sse2")))
+  bool thinning_zs_iteration_sse2(int iter){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+    const __m128i two  = _mm_set1_epi8(2);
+    const __m128i six  = _mm_set1_epi8(6);
+    const __m128i hi   = _mm_set1_epi8((char)0xFE);
+    for (int i = 1; i < H-1; i++){
+      uchar* up  = im+(i-1)*W;
+      uchar* mid = im+i*W;
+      uchar* dn  = im+(i+1)*W;
+      int j = 1;
+      for (; j+16 <= W-1; j += 16){
+        __m128i p2 = _mm_and_si128(_mm_loadu_si128((__m128i*)(up+j)),   one);
+        __m128i p3 = _mm_and_si128(_mm_loadu_si128((__m128i*)(up+j+1)), one);
+        __m128i p4 = _mm_and_si128(_mm_loadu_si128((__m128i*)(mid+j+1)),one);
+        __m128i p5 = _mm_and_si128(_mm_loadu_si128((__m128i*)(dn+j+1)), one);
+        __m128i p6 = _mm_and_si128(_mm_loadu_si128((__m128i*)(dn+j)),   one);
+        __m128i p7 = _mm_and_si128(_mm_loadu_si128((__m128i*)(dn+j-1)), one);
+        __m128i p8 = _mm_and_si128(_mm_loadu_si128((__m128i*)(mid+j-1)),one);
+        __m128i p9 = _mm_and_si128(_mm_loadu_si128((__m128i*)(up+j-1)), one);
+
+        __m128i A = _mm_add_epi8(
+          _mm_add_epi8(_mm_add_epi8(_mm_andnot_si128(p2,p3),_mm_andnot_si128(p3,p4)),
+                       _mm_add_epi8(_mm_andnot_si128(p4,p5),_mm_andnot_si128(p5,p6))),
+          _mm_add_epi8(_mm_add_epi8(_mm_andnot_si128(p6,p7),_mm_andnot_si128(p7,p8)),
+                       _mm_add_epi8(_mm_andnot_si128(p8,p9),_mm_andnot_si128(p9,p2))));
+        __m128i B = _mm_add_epi8(
+          _mm_add_epi8(_mm_add_epi8(p2,p3),_mm_add_epi8(p4,p5)),
+          _mm_add_epi8(_mm_add_epi8(p6,p7),_mm_add_epi8(p8,p9)));
+        __m128i m = iter == 0 ?
+          _mm_or_si128(_mm_and_si128(_mm_and_si128(p2,p4),p6),_mm_and_si128(_mm_and_si128(p4,p6),p8)) :
+          _mm_or_si128(_mm_and_si128(_mm_and_si128(p2,p4),p8),_mm_and_si128(_mm_and_si128(p2,p6),p8));
+
+        __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(A,one),_mm_cmpeq_epi8(m,zero));
+        ok = _mm_and_si128(ok,_mm_cmpeq_epi8(_mm_max_epu8(B,two),B)); // B >= 2
+        ok = _mm_and_si128(ok,_mm_cmpeq_epi8(_mm_min_epu8(B,six),B)); // B <= 6
+        __m128i c = _mm_loadu_si128((__m128i*)(mid+j));
+        _mm_storeu_si128((__m128i*)(mid+j),_mm_or_si128(c,_mm_and_si128(ok,two)));
+      }
+      for (; j < W-1; j++){
+        thinning_zs_mark(i,j,iter);
+      }
+    }
+    __m128i acc = zero;
+    int k = 0;
+    for (; k+16 <= H*W; k += 16){
+      __m128i v   = _mm_loadu_si128((__m128i*)(im+k));
+      __m128i old = _mm_and_si128(v,one);
+      __m128i nv  = _mm_and_si128(old,_mm_cmpeq_epi8(_mm_and_si128(v,hi),zero));
+      _mm_storeu_si128((__m128i*)(im+k),nv);
+      acc = _mm_or_si128(acc,_mm_xor_si128(nv,old));
+    }
+    bool diff = _mm_movemask_epi8(_mm_cmpeq_epi8(acc,zero)) != 0xFFFF;
+    diff |= thinning_zs_unmark(k,H*W);
+    return diff;
+  }
+
+  __attribute__((target("avx2")))
+  bool thinning_zs_iteration_avx2(int iter){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi8(1);
+    const __m256i two  = _mm256_set1_epi8(2);
+    const __m256i six  = _mm256_set1_epi8(6);
+    const __m256i hi   = _mm256_set1_epi8((char)0xFE);
+    for (int i = 1; i < H-1; i++){
+      uchar* up  = im+(i-1)*W;
+      uchar* mid = im+i*W;
+      uchar* dn  = im+(i+1)*W;
+      int j = 1;
+      for (; j+32 <= W-1; j += 32){
+        __m256i p2 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(up+j)),   one);
+        __m256i p3 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(up+j+1)), one);
+        __m256i p4 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(mid+j+1)),one);
+        __m256i p5 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(dn+j+1)), one);
+        __m256i p6 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(dn+j)),   one);
+        __m256i p7 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(dn+j-1)), one);
+        __m256i p8 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(mid+j-1)),one);
+        __m256i p9 = _mm256_and_si256(_mm256_loadu_si256((__m256i*)(up+j-1)), one);
+
+        __m256i A = _mm256_add_epi8(
+          _mm256_add_epi8(_mm256_add_epi8(_mm256_andnot_si256(p2,p3),_mm256_andnot_si256(p3,p4)),
+                          _mm256_add_epi8(_mm256_andnot_si256(p4,p5),_mm256_andnot_si256(p5,p6))),
+          _mm256_add_epi8(_mm256_add_epi8(_mm256_andnot_si256(p6,p7),_mm256_andnot_si256(p7,p8)),
+                          _mm256_add_epi8(_mm256_andnot_si256(p8,p9),_mm256_andnot_si256(p9,p2))));
+        __m256i B = _mm256_add_epi8(
+          _mm256_add_epi8(_mm256_add_epi8(p2,p3),_mm256_add_epi8(p4,p5)),
+          _mm256_add_epi8(_mm256_add_epi8(p6,p7),_mm256_add_epi8(p8,p9)));
+        __m256i m = iter == 0 ?
+          _mm256_or_si256(_mm256_and_si256(_mm256_and_si256(p2,p4),p6),_mm256_and_si256(_mm256_and_si256(p4,p6),p8)) :
+          _mm256_or_si256(_mm256_and_si256(_mm256_and_si256(p2,p4),p8),_mm256_and_si256(_mm256_and_si256(p2,p6),p8));
+
+        __m256i ok = _mm256_and_si256(_mm256_cmpeq_epi8(A,one),_mm256_cmpeq_epi8(m,zero));
+        ok = _mm256_and_si256(ok,_mm256_cmpeq_epi8(_mm256_max_epu8(B,two),B)); // B >= 2
+        ok = _mm256_and_si256(ok,_mm256_cmpeq_epi8(_mm256_min_epu8(B,six),B)); // B <= 6
+        __m256i c = _mm256_loadu_si256((__m256i*)(mid+j));
+        _mm256_storeu_si256((__m256i*)(mid+j),_mm256_or_si256(c,_mm256_and_si256(ok,two)));
+      }
+      for (; j < W-1; j++){
+        thinning_zs_mark(i,j,iter);
       }
-      return 1;    
     }
+    __m256i acc = zero;
+    int k = 0;
+    for (; k+32 <= H*W; k += 32){
+      __m256i v   = _mm256_loadu_si256((__m256i*)(im+k));
+      __m256i old = _mm256_and_si256(v,one);
+      __m256i nv  = _mm256_and_si256(old,_mm256_cmpeq_epi8(_mm256_and_si256(v,hi),zero));
+      _mm256_storeu_si256((__m256i*)(im+k),nv);
+      acc = _mm256_or_si256(acc,_mm256_xor_si256(nv,old));
+    }
+    bool diff = !_mm256_testz_si256(acc,acc);
+    diff |= thinning_zs_unmark(k,H*W);
+    return diff;
+  }
+#endif
+
+  // widest thinning kernel supported by this CPU (checked with cpuid once):
+  // 2 = AVX2, 1 = SSE2, 0 = scalar
+  static int thinning_simd_level(){
+  #if THINNING_X86
+    static const int level = __builtin_cpu_supports("avx2") ? 2 :
+                             __builtin_cpu_supports("sse2") ? 1 : 0;
+    return level;
+  #else
     return 0;
+  #endif
   }
 
-  /**merge fragments from two chunks
-   * @param c0   fragments from first  chunk
-   * @param c1   fragments from second chunk
-   * @param sx   (x or y) coordinate of the seam
-   * @param dr   merge direction, HORIZONTAL or VERTICAL?
-   */
-  polyline_t* merge_frags(polyline_t* c0, polyline_t* c1, int sx, int dr){
-    if (!c0){
-      return c1;
+  bool thinning_zs_iteration_simd(int level, int iter){
+  #if THINNING_X86
+    if (level >= 2){
+      return thinning_zs_iteration_avx2(iter);
     }
-    if (!c1){
-      return c0;
+    if (level == 1){
+      return thinning_zs_iteration_sse2(iter);
     }
-    polyline_t* it = c1;
-    while(it){
-      polyline_t* tmp = it->next;
-      if (dr == HORIZONTAL){
-        if (merge_impl(c0,it,sx,0,1))goto rem;
-        if (merge_impl(c0,it,sx,0,3))goto rem;
-        if (merge_impl(c0,it,sx,0,0))goto rem;
-        if (merge_impl(c0,it,sx,0,2))goto rem;
-      }else{
-        if (merge_impl(c0,it,sx,1,1))goto rem;
-        if (merge_impl(c0,it,sx,1,3))goto rem;
-        if (merge_impl(c0,it,sx,1,0))goto rem;
-        if (merge_impl(c0,it,sx,1,2))goto rem;      
-      }
-      goto next;
-      rem:
-      if (!it->prev){
-        c1 = it->next;
-        if (it->next){
-          it->next->prev = NULL;
-        }
-      }else{
-        it->prev->next = it->next;
-        if (it->next){
-          it->next->prev = it->prev;
+  #else
+    (void)level; // scalar only
+  #endif
+    return thinning_zs_iteration(iter);
+  }
+
+  void thinning_zs_simd(){
+    int level = thinning_simd_level();
+    bool diff = true;
+    thinning_iterations = 0;
+    do {
+      thinning_iterations += 2;
+      diff &= thinning_zs_iteration_simd(level,0);
+      diff &= thinning_zs_iteration_simd(level,1);
+    }while (diff);
+  }
+
+  // Lookup-table thinning: the 8 neighbours are packed into a code
+  // (bit 0 = p2, north, then clockwise to bit 7 = p9, north-west) and the
+  // deletion decision for each code is precomputed at compile time.
+  // To try another rule, write a constexpr predicate like thinning_zs_rule()
+  // and pass its tables to thinning_lut_iteration().
+
+  static constexpr int lut_p(int c, int k){ // neighbour p(k+2) of code c
+    return (c >> (k&7)) & 1;
+  }
+  static constexpr int lut_A(int c){ // number of 0->1 transitions around p2..p9,p2
+    return (!lut_p(c,0)&&lut_p(c,1)) + (!lut_p(c,1)&&lut_p(c,2)) +
+           (!lut_p(c,2)&&lut_p(c,3)) + (!lut_p(c,3)&&lut_p(c,4)) +
+           (!lut_p(c,4)&&lut_p(c,5)) + (!lut_p(c,5)&&lut_p(c,6)) +
+           (!lut_p(c,6)&&lut_p(c,7)) + (!lut_p(c,7)&&lut_p(c,0));
+  }
+  static constexpr int lut_B(int c){ // number of set neighbours
+    return lut_p(c,0)+lut_p(c,1)+lut_p(c,2)+lut_p(c,3)+
+           lut_p(c,4)+lut_p(c,5)+lut_p(c,6)+lut_p(c,7);
+  }
+  static constexpr uchar thinning_zs_rule(int c, int iter){
+    return lut_A(c) == 1 && lut_B(c) >= 2 && lut_B(c) <= 6 &&
+      (iter == 0 ? !(lut_p(c,0)&&lut_p(c,2)&&lut_p(c,4)) && !(lut_p(c,2)&&lut_p(c,4)&&lut_p(c,6))
+                 : !(lut_p(c,0)&&lut_p(c,2)&&lut_p(c,6)) && !(lut_p(c,0)&&lut_p(c,4)&&lut_p(c,6)));
+  }
+  static const uchar* thinning_zs_lut_table(int iter){
+    static constexpr uchar lut[2][256] = {
+      {THINNING_LUT_256(thinning_zs_rule,0)},
+      {THINNING_LUT_256(thinning_zs_rule,1)},
+    };
+    return lut[iter];
+  }
+
+  // neighbour code of pixel (i,j), see above for the bit order
+  inline int thinning_lut_code(int i, int j){
+    uchar* up  = im+(i-1)*W+j;
+    uchar* mid = im+i*W+j;
+    uchar* dn  = im+(i+1)*W+j;
+    return  (up[0]  & 1)     | (up[1]  & 1)<<1 | (mid[1] & 1)<<2 | (dn[1] & 1)<<3 |
+            (dn[0]  & 1)<<4  | (dn[-1] & 1)<<5 | (mid[-1]& 1)<<6 | (up[-1]& 1)<<7;
+  }
+
+  // one sub-iteration of a lookup-table driven thinning rule
+  bool thinning_lut_iteration(const uchar* lut){
+    for (int i = 1; i < H-1; i++){
+      for (int j = 1; j < W-1; j++){
+        if ((im[i*W+j] & 1) && lut[thinning_lut_code(i,j)]){ // background needs no lookup
+          im[i*W+j] |= 2;
         }
       }
-      free(it);
-      next:
-      it = tmp;
     }
-    it = c1;
-    while(it){
-      polyline_t* tmp = it->next;
-      it->prev = NULL;
-      it->next = NULL;
-      c0 = prepend_polyline(c0,it);
-      it = tmp;
+    return thinning_zs_unmark(0,H*W);
+  }
+
+  void thinning_zs_lut(){
+    bool diff = true;
+    thinning_iterations = 0;
+    do {
+      thinning_iterations += 2;
+      diff &= thinning_lut_iteration(thinning_zs_lut_table(0));
+      diff &= thinning_lut_iteration(thinning_zs_lut_table(1));
+    }while (diff);
+  }
+
+  // Worklist thinning: instead of rescanning the whole image, each
+  // sub-iteration only visits pixels whose neighbourhood changed since the
+  // last sub-iteration of the same kind, i.e. pixels next to something
+  // deleted in the previous two sub-iterations. The first two start from
+  // the foreground pixels on the border of the strokes (pixels with all
+  // 8 neighbours set can never be deleted). Cost is proportional to the
+  // stroke perimeter instead of image area times iteration count.
+
+  typedef struct _index_list_t {
+    int* data;
+    int size;
+    int cap;
+  } index_list_t;
+
+  void push_index(index_list_t* l, int v){
+    if (l->size >= l->cap){
+      l->cap = l->cap ? l->cap*2 : 256;
+      l->data = (int*)realloc(l->data, l->cap*sizeof(int));
     }
-    return c0;
+    l->data[l->size++] = v;
   }
 
-  /**recursive bottom: turn chunk into polyline fragments;
-   * look around on 4 edges of the chunk, and identify the "outgoing" pixels;
-   * add segments connecting these pixels to center of chunk;
-   * apply heuristics to adjust center of chunk
-   *
-   * @param x    left of   chunk
-   * @param y    top of    chunk
-   * @param w    width of  chunk
-   * @param h    height of chunk
-   * @return     the polyline fragments
+  // queue the interior foreground pixels around index k (bit 2 marks queued)
+  inline void thinning_worklist_touch(index_list_t* l, int k){
+    int i = k / W;
+    int j = k % W;
+    for (int di = -1; di <= 1; di++){
+      for (int dj = -1; dj <= 1; dj++){
+        int ii = i+di;
+        int jj = j+dj;
+        if (ii < 1 || jj < 1 || ii >= H-1 || jj >= W-1){
+          continue;
+        }
+        uchar* q = im+ii*W+jj;
+        if ((*q & 1) && !(*q & 4)){
+          *q |= 4;
+          push_index(l, ii*W+jj);
+        }
+      }
+    }
+  }
+
+  /**one sub-iteration over the worklist
+   * @param cand  pixels to test, consumed
+   * @param del   receives the deleted pixels
+   * @param iter  sub-iteration, 0 or 1
+   * @return      whether any pixel was deleted
+   */
+  bool thinning_worklist_iteration(index_list_t* cand, index_list_t* del, int iter){
+    const uchar* lut = thinning_zs_lut_table(iter);
+    del->size = 0;
+    for (int n = 0; n < cand->size; n++){
+      int k = cand->data[n];
+      im[k] &= ~4;
+      if (lut[thinning_lut_code(k/W,k%W)]){
+        push_index(del, k);
+      }
+    }
+    for (int n = 0; n < del->size; n++){
+      im[del->data[n]] = 0;
+    }
+    cand->size = 0;
+    return del->size > 0;
+  }
+
+  void thinning_zs_worklist(){
+    index_list_t border = {NULL,0,0}; // initial candidates, used by the first 2 sub-iterations
+    index_list_t cand   = {NULL,0,0};
+    index_list_t del0   = {NULL,0,0}; // deletions of the previous sub-iteration
+    index_list_t del1   = {NULL,0,0}; // deletions of this sub-iteration
+    for (int i = 0; i < H*W; i++){
+      im[i] &= 1;
+    }
+    for (int i = 1; i < H-1; i++){
+      for (int j = 1; j < W-1; j++){
+        if ((im[i*W+j] & 1) && thinning_lut_code(i,j) != 0xFF){
+          push_index(&border, i*W+j);
+        }
+      }
+    }
+    for (int n = 0; n < border.size; n++){
+      im[border.data[n]] |= 4;
+      push_index(&cand, border.data[n]);
+    }
+    bool diff = true;
+    int iter = 0;
+    int count = 0;
+    do {
+      bool d = thinning_worklist_iteration(&cand, &del1, iter);
+      if (count == 0){ // the second sub-iteration hasn't seen the border yet
+        for (int n = 0; n < border.size; n++){
+          if ((im[border.data[n]] & 5) == 1){
+            im[border.data[n]] |= 4;
+            push_index(&cand, border.data[n]);
+          }
+        }
+      }
+      for (int n = 0; n < del0.size; n++){
+        thinning_worklist_touch(&cand, del0.data[n]);
+      }
+      for (int n = 0; n < del1.size; n++){
+        thinning_worklist_touch(&cand, del1.data[n]);
+      }
+      index_list_t tmp = del0; del0 = del1; del1 = tmp;
+      diff &= d;
+      iter = 1-iter;
+      count++;
+    }while (diff || iter == 1);
+    thinning_iterations = count;
+    for (int n = 0; n < cand.size; n++){
+      im[cand.data[n]] &= 1;
+    }
+    free(border.data);
+    free(cand.data);
+    free(del0.data);
+    free(del1.data);
+  }
+
+  // Double-buffered thinning: each sub-iteration reads one buffer and
+  // writes the thinned result straight into the other, so there is no
+  // separate marker-clearing pass; "changed" is tracked during the sweep.
+  // Border rows and columns are never deleted, so they are copied once.
+  // Works with any pair of lookup tables, see thinning_lut_iteration().
+  bool thinning_double_buffer_iteration(uchar* src, uchar* dst, const uchar* lut){
+    bool diff = false;
+    for (int i = 1; i < H-1; i++){
+      uchar* up  = src+(i-1)*W;
+      uchar* mid = src+i*W;
+      uchar* dn  = src+(i+1)*W;
+      uchar* out = dst+i*W;
+      for (int j = 1; j < W-1; j++){
+        uchar v = mid[j];
+        if (v){
+          int c = up[j]     | up[j+1]<<1 | mid[j+1]<<2 | dn[j+1]<<3 |
+                  dn[j]<<4  | dn[j-1]<<5 | mid[j-1]<<6 | up[j-1]<<7;
+          if (lut[c]){
+            v = 0;
+            diff = true;
+          }
+        }
+        out[j] = v;
+      }
+    }
+    return diff;
+  }
+
+  void thinning_lut_double_buffer(const uchar* lut0, const uchar* lut1){
+    for (int i = 0; i < H*W; i++){
+      im[i] &= 1;
+    }
+    uchar* buf = (uchar*)malloc(W*H);
+    memcpy(buf, im, W*H);
+    uchar* src = im;
+    uchar* dst = buf;
+    bool diff = true;
+    thinning_iterations = 0;
+    do {
+      thinning_iterations += 2;
+      for (int iter = 0; iter < 2; iter++){
+        diff &= thinning_double_buffer_iteration(src,dst,iter ? lut1 : lut0);
+        uchar* tmp = src; src = dst; dst = tmp;
+      }
+    }while (diff);
+    if (src != im){
+      memcpy(im, src, W*H);
+    }
+    free(buf);
+  }
+
+  void thinning_zs_double_buffer(){
+    thinning_lut_double_buffer(thinning_zs_lut_table(0),thinning_zs_lut_table(1));
+  }
+
+  // Temporally tiled Zhang-Suen, for images larger than the cache.
+  // Instead of streaming the whole image through every sub-iteration, the
+  // image is cut into tiles and each tile, padded with a halo as wide as
+  // the number of sub-iterations, is copied into two small buffers and
+  // thinned there for THINNING_TILE_ROUNDS iterations. After s steps only
+  // pixels at least s away from the halo's edge are still exact, so the
+  // inner tile is exact at the end and is written to the output image.
+  // Halos overlap, so all tiles read the same (older) input.
+  // Changes are recorded per sub-iteration inside the inner tiles, which
+  // gives the same convergence test as thinning_zs(). If it converges in
+  // the middle of a block, the block is redone with fewer iterations, so
+  // the result is identical to thinning_zs().
+
+  /**run sub-iterations on one tile
+   * @param src     input image, before the block
+   * @param dst     output image, receives the inner tile
+   * @param x0,y0   top left of the inner tile
+   * @param x1,y1   bottom right (exclusive) of the inner tile
+   * @param steps   number of sub-iterations, starting with sub-iteration 0
+   * @param l0,l1   scratch buffers, large enough for the tile and its halo
+   * @param changed per sub-iteration flags, set if the inner tile changed
+   */
+  void thinning_tile(uchar* src, uchar* dst, int x0, int y0, int x1, int y1, int steps,
+                     uchar* l0, uchar* l1, bool* changed){
+    int px0 = x0-steps < 0 ? 0 : x0-steps;
+    int py0 = y0-steps < 0 ? 0 : y0-steps;
+    int px1 = x1+steps > W ? W : x1+steps;
+    int py1 = y1+steps > H ? H : y1+steps;
+    int tw = px1-px0;
+    for (int i = py0; i < py1; i++){
+      memcpy(l0+(i-py0)*tw, src+i*W+px0, tw);
+      memcpy(l1+(i-py0)*tw, src+i*W+px0, tw);
+    }
+    uchar* a = l0;
+    uchar* b = l1;
+    for (int s = 0; s < steps; s++){
+      const uchar* lut = thinning_zs_lut_table(s&1);
+      int r = steps-s-1; // after this step, pixels within r of the inner tile are exact
+      int ci0 = y0-r < 1 ? 1 : y0-r;
+      int cj0 = x0-r < 1 ? 1 : x0-r;
+      int ci1 = y1+r > H-1 ? H-1 : y1+r;
+      int cj1 = x1+r > W-1 ? W-1 : x1+r;
+      for (int i = ci0; i < ci1; i++){
+        uchar* up  = a+(i-py0-1)*tw-px0;
+        uchar* mid = a+(i-py0)*tw-px0;
+        uchar* dn  = a+(i-py0+1)*tw-px0;
+        uchar* out = b+(i-py0)*tw-px0;
+        bool inner = i >= y0 && i < y1;
+        for (int j = cj0; j < cj1; j++){
+          uchar v = mid[j];
+          if (v){
+            int c = up[j]     | up[j+1]<<1 | mid[j+1]<<2 | dn[j+1]<<3 |
+                    dn[j]<<4  | dn[j-1]<<5 | mid[j-1]<<6 | up[j-1]<<7;
+            if (lut[c]){
+              v = 0;
+              if (inner && j >= x0 && j < x1){
+                changed[s] = true;
+              }
+            }
+          }
+          out[j] = v;
+        }
+      }
+      uchar* tmp = a; a = b; b = tmp;
+    }
+    for (int i = y0; i < y1; i++){
+      memcpy(dst+i*W+x0, a+(i-py0)*tw+x0-px0, x1-x0);
+    }
+  }
+
+  // run `rounds` Zhang-Suen iterations over all tiles, src -> dst
+  void thinning_tiled_block(uchar* src, uchar* dst, int rounds, uchar* l0, uchar* l1, bool* changed){
+    int ts = THINNING_TILE_SIZE;
+    for (int s = 0; s < rounds*2; s++){
+      changed[s] = false;
+    }
+    for (int y = 0; y < H; y += ts){
+      for (int x = 0; x < W; x += ts){
+        int x1 = x+ts > W ? W : x+ts;
+        int y1 = y+ts > H ? H : y+ts;
+        thinning_tile(src,dst,x,y,x1,y1,rounds*2,l0,l1,changed);
+      }
+    }
+  }
+
+  void thinning_zs_tiled(){
+    int rounds = THINNING_TILE_ROUNDS;
+    int side = THINNING_TILE_SIZE+rounds*4;
+    uchar* l0  = (uchar*)malloc(side*side);
+    uchar* l1  = (uchar*)malloc(side*side);
+    uchar* buf = (uchar*)malloc(W*H);
+    bool* changed = (bool*)malloc(rounds*2*sizeof(bool));
+    for (int i = 0; i < H*W; i++){
+      im[i] &= 1;
+    }
+    uchar* src = im;
+    uchar* dst = buf;
+    thinning_iterations = 0;
+    while (true){
+      thinning_tiled_block(src,dst,rounds,l0,l1,changed);
+      int r = 0; // first iteration in this block where thinning_zs() would stop
+      while (r < rounds && changed[r*2] && changed[r*2+1]){
+        r++;
+      }
+      if (r == rounds){
+        thinning_iterations += rounds*2;
+        uchar* tmp = src; src = dst; dst = tmp;
+        continue;
+      }
+      if (r < rounds-1){
+        thinning_tiled_block(src,dst,r+1,l0,l1,changed);
+      }
+      thinning_iterations += (r+1)*2;
+      break;
+    }
+    if (dst != im){
+      memcpy(im, dst, W*H);
+    }
+    free(l0);
+    free(l1);
+    free(buf);
+    free(changed);
+  }
+
+  //================================
+  // OTHER THINNING ALGORITHMS
+  //================================
+  // These don't reproduce Zhang-Suen, they trade it for fewer iterations
+  // or thinner diagonals; compare them with benchmark.cpp.
+
+  // Guo-Hall 1989, algorithm A1. Same 2 sub-iteration scheme as Zhang-Suen,
+  // but removes the 2-pixel-thick diagonal staircases that Zhang-Suen leaves.
+  // Z. Guo and R. W. Hall, "Parallel thinning with two-subiteration algorithms"
+  static constexpr int lut_or(int c, int a, int b){
+    return lut_p(c,a) | lut_p(c,b);
+  }
+  static constexpr uchar thinning_gh_rule(int c, int iter){
+    return // C(p) == 1
+      (!lut_p(c,0) && lut_or(c,1,2)) + (!lut_p(c,2) && lut_or(c,3,4)) +
+      (!lut_p(c,4) && lut_or(c,5,6)) + (!lut_p(c,6) && lut_or(c,7,0)) == 1 &&
+      // 2 <= N(p) <= 3
+      thinning_gh_N(c) >= 2 && thinning_gh_N(c) <= 3 &&
+      // iter 0: (p6 | p7 | !p9) & p8 == 0, iter 1: (p2 | p3 | !p5) & p4 == 0
+      (iter == 0 ? !((lut_p(c,4) || lut_p(c,5) || !lut_p(c,7)) && lut_p(c,6))
+                 : !((lut_p(c,0) || lut_p(c,1) || !lut_p(c,3)) && lut_p(c,2)));
+  }
+  static constexpr int thinning_gh_N(int c){
+    return lut_or(c,7,0)+lut_or(c,1,2)+lut_or(c,3,4)+lut_or(c,5,6) <
+           lut_or(c,0,1)+lut_or(c,2,3)+lut_or(c,4,5)+lut_or(c,6,7) ?
+           lut_or(c,7,0)+lut_or(c,1,2)+lut_or(c,3,4)+lut_or(c,5,6) :
+           lut_or(c,0,1)+lut_or(c,2,3)+lut_or(c,4,5)+lut_or(c,6,7);
+  }
+  static const uchar* thinning_gh_lut_table(int iter){
+    static constexpr uchar lut[2][256] = {
+      {THINNING_LUT_256(thinning_gh_rule,0)},
+      {THINNING_LUT_256(thinning_gh_rule,1)},
+    };
+    return lut[iter];
+  }
+
+  void thinning_guo_hall(){
+    thinning_lut_double_buffer(thinning_gh_lut_table(0),thinning_gh_lut_table(1));
+  }
+
+  // Holt et al. 1987, a one-subcycle parallel variant of Zhang-Suen.
+  // A pixel is an "edge" if it has 2..6 neighbours and exactly one 0->1
+  // transition around it. An edge pixel is deleted unless one of its
+  // east/south neighbours is an edge pixel that would take its place,
+  // which needs a 4x4 window but only one pass per iteration, so it
+  // converges in fewer passes than Zhang-Suen's two per iteration.
+  // C. M. Holt, A. Stewart, M. Clint and R. H. Perrott,
+  // "An improved parallel thinning algorithm"
+  static constexpr uchar thinning_edge_rule(int c, int){
+    return lut_A(c) == 1 && lut_B(c) >= 2 && lut_B(c) <= 6;
+  }
+  static const uchar* thinning_edge_lut_table(){
+    static constexpr uchar lut[256] = {THINNING_LUT_256(thinning_edge_rule,0)};
+    return lut;
+  }
+
+  void thinning_holt(){
+    const uchar* lut = thinning_edge_lut_table();
+    uchar* edge = (uchar*)calloc(W*H, 1); // edge pixels, never set on the image border
+    for (int i = 0; i < H*W; i++){
+      im[i] &= 1;
+    }
+    bool diff = true;
+    thinning_iterations = 0;
+    while (diff){
+      thinning_iterations++;
+      for (int i = 1; i < H-1; i++){
+        for (int j = 1; j < W-1; j++){
+          edge[i*W+j] = im[i*W+j] && lut[thinning_lut_code(i,j)];
+        }
+      }
+      for (int i = 1; i < H-1; i++){
+        for (int j = 1; j < W-1; j++){
+          int k = i*W+j;
+          if (!edge[k]){
+            continue;
+          }
+          uchar eE  = edge[k+1];
+          uchar eS  = edge[k+W];
+          uchar eSE = edge[k+W+1];
+          uchar vN  = im[k-W] & 1;
+          uchar vS  = im[k+W] & 1;
+          uchar vE  = im[k+1] & 1;
+          uchar vW  = im[k-1] & 1;
+          if (!((eE && vN && vS) || (eS && vW && vE) || (eE && eSE && eS))){
+            im[k] |= 2;
+          }
+        }
+      }
+      diff = thinning_zs_unmark(0,H*W);
+    }
+    free(edge);
+  }
+
+  // Distance-ordered thinning, for thick strokes where the number of
+  // Zhang-Suen iterations grows with the stroke width.
+  // A two-pass 3-4 chamfer distance transform gives each foreground pixel
+  // its distance to the background. Pixels are then visited level by level
+  // in increasing distance and deleted one at a time if they are simple.
+  // End points are kept only on a ridge of the distance map, otherwise
+  // the tips left behind by the peeling order would grow into spurs.
+  // Since deletion is sequential, the simple point test is the exact one
+  // (8-connected Yokoi number of 1) rather than Zhang-Suen's single 0->1
+  // transition, which would leave 4-connected staircases.
+  // Deleting a pixel requeues its neighbours of the current or lower levels,
+  // so each pixel is visited a bounded number of times regardless of stroke
+  // width. thinning_iterations counts the distance levels.
+  static constexpr int lut_q(int c, int k){ // complement of neighbour p(k+2)
+    return 1-lut_p(c,k);
+  }
+  static constexpr int lut_yokoi8(int c){ // 8-connectivity number
+    return lut_q(c,0)-lut_q(c,0)*lut_q(c,1)*lut_q(c,2) + lut_q(c,2)-lut_q(c,2)*lut_q(c,3)*lut_q(c,4) +
+           lut_q(c,4)-lut_q(c,4)*lut_q(c,5)*lut_q(c,6) + lut_q(c,6)-lut_q(c,6)*lut_q(c,7)*lut_q(c,0);
+  }
+  static constexpr uchar thinning_simple_rule(int c, int){
+    return lut_yokoi8(c) == 1;
+  }
+  static const uchar* thinning_simple_lut_table(){
+    static constexpr uchar lut[256] = {THINNING_LUT_256(thinning_simple_rule,0)};
+    return lut;
+  }
+
+  void thinning_distance(){
+    const uchar* lut = thinning_simple_lut_table();
+    int* dt = (int*)malloc(W*H*sizeof(int));
+    for (int i = 0; i < H*W; i++){
+      im[i] &= 1;
+    }
+    // outside of the image counts as background
+    auto at = [&](int i, int j){
+      return (i < 0 || j < 0 || i >= H || j >= W) ? 0 : dt[i*W+j];
+    };
+    int dmax = 0;
+    for (int i = 0; i < H; i++){
+      for (int j = 0; j < W; j++){
+        int k = i*W+j;
+        dt[k] = !im[k] ? 0 : std::min(std::min(at(i-1,j-1)+4, at(i-1,j)+3),
+                                      std::min(at(i-1,j+1)+4, at(i,j-1)+3));
+      }
+    }
+    for (int i = H-1; i >= 0; i--){
+      for (int j = W-1; j >= 0; j--){
+        int k = i*W+j;
+        if (im[k]){
+          dt[k] = std::min(std::min(dt[k], std::min(at(i+1,j+1)+4, at(i+1,j)+3)),
+                                           std::min(at(i+1,j-1)+4, at(i,j+1)+3));
+          dmax = std::max(dmax, dt[k]);
+        }
+      }
+    }
+    // counting sort the interior foreground pixels by distance
+    int* start = (int*)calloc(dmax+2, sizeof(int));
+    for (int i = 1; i < H-1; i++){
+      for (int j = 1; j < W-1; j++){
+        if (im[i*W+j]){
+          start[dt[i*W+j]+1]++;
+        }
+      }
+    }
+    for (int d = 0; d <= dmax; d++){
+      start[d+1] += start[d];
+    }
+    int* order = (int*)malloc((start[dmax+1]+1)*sizeof(int));
+    int* fill = (int*)malloc((dmax+1)*sizeof(int));
+    memcpy(fill, start, (dmax+1)*sizeof(int));
+    for (int i = 1; i < H-1; i++){
+      for (int j = 1; j < W-1; j++){
+        if (im[i*W+j]){
+          order[fill[dt[i*W+j]]++] = i*W+j;
+        }
+      }
+    }
+    index_list_t cur = {NULL,0,0};
+    index_list_t nxt = {NULL,0,0};
+    thinning_iterations = 0;
+    for (int d = 0; d <= dmax; d++){
+      if (start[d] == start[d+1]){
+        continue;
+      }
+      thinning_iterations++;
+      for (int n = start[d]; n < start[d+1]; n++){
+        im[order[n]] |= 4;
+        push_index(&cur, order[n]);
+      }
+      while (cur.size){
+        for (int n = 0; n < cur.size; n++){
+          int k = cur.data[n];
+          im[k] &= ~4;
+          int c = thinning_lut_code(k/W,k%W);
+          if (!im[k] || !lut[c]){
+            continue;
+          }
+          if (lut_B(c) == 1){ // end point: keep it only if it lies on a distance ridge
+            bool ridge = true;
+            for (int di = -W; di <= W && ridge; di += W){
+              for (int dj = -1; dj <= 1; dj++){
+                if (dt[k+di+dj] > dt[k]){
+                  ridge = false;
+                  break;
+                }
+              }
+            }
+            if (ridge){
+              continue;
+            }
+          }
+          im[k] = 0;
+          for (int di = -W; di <= W; di += W){
+            for (int dj = -1; dj <= 1; dj++){
+              int q = k+di+dj;
+              int qi = q/W;
+              int qj = q%W;
+              if (qi < 1 || qj < 1 || qi >= H-1 || qj >= W-1){
+                continue;
+              }
+              if (im[q] == 1 && dt[q] <= d){ // foreground, not queued, already reached
+                im[q] |= 4;
+                push_index(&nxt, q);
+              }
+            }
+          }
+        }
+        index_list_t tmp = cur; cur = nxt; nxt = tmp;
+        nxt.size = 0;
+      }
+    }
+    free(cur.data);
+    free(nxt.data);
+    free(order);
+    free(fill);
+    free(start);
+    free(dt);
+  }
+
+  // run the raster thinning engine selected by thinning_mode
+  void thinning(){
+    if (thinning_mode == THINNING_BITPACKED){
+      thinning_zs_bits();
+    }else if (thinning_mode == THINNING_SIMD){
+      thinning_zs_simd();
+    }else if (thinning_mode == THINNING_LUT){
+      thinning_zs_lut();
+    }else if (thinning_mode == THINNING_WORKLIST){
+      thinning_zs_worklist();
+    }else if (thinning_mode == THINNING_DOUBLE_BUFFER){
+      thinning_zs_double_buffer();
+    }else if (thinning_mode == THINNING_GUO_HALL){
+      thinning_guo_hall();
+    }else if (thinning_mode == THINNING_HOLT){
+      thinning_holt();
+    }else if (thinning_mode == THINNING_TILED){
+      thinning_zs_tiled();
+    }else if (thinning_mode == THINNING_DISTANCE){
+      thinning_distance();
+    }else{
+      thinning_zs();
+    }
+  }
+
+  //================================
+  // MAIN ALGORITHM
+  //================================
+
+  /**build the occupancy tables of a region: the region packed into bits by
+   * rows and by columns, with running counts of white pixels per 64-bit
+   * word, so that the white pixels of any run of a row or column are
+   * counted in O(1) (seam scores); and a pyramid of which 8x8 and 64x64
+   * blocks hold white pixels, so that emptiness tests skip blank space.
+   * Pixels are read 8 at a time, blank words and blocks are skipped, and
+   * the tables take about 3 bits per pixel.
+   * @param x    left of   region
+   * @param y    top of    region
+   * @param w    width of  region
+   * @param h    height of region
+   */
+  void build_occupancy(int x, int y, int w, int h){
+    int nw = (w+63)/64, nh = (h+63)/64;
+    int w8 = (w+7)/8, h8 = (h+7)/8;
+    occ.x = x;
+    occ.y = y;
+    occ.w8 = w8;
+    occ.nw = nw;
+    occ.nh = nh;
+    occ.rows = (uint64_t*)calloc(h*nw+1, sizeof(uint64_t)); // +1: count_span() may read (with an empty mask) one past the end
+    occ.cols = (uint64_t*)calloc(w*nh+1, sizeof(uint64_t));
+    occ.rsum = (int*)malloc(sizeof(int)*h*(nw+1));
+    occ.csum = (int*)malloc(sizeof(int)*w*(nh+1));
+    occ.b8 = (uchar*)calloc(w8*h8, 1);
+    occ.b64 = (uchar*)calloc(nw*nh, 1);
+    for (int i = 0; i < h; i++){
+      const uchar* p = im+(y+i)*W+x;
+      uint64_t* r = occ.rows+i*nw;
+      int j = 0;
+    #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      for (; j+8 <= w; j += 8){ // gather bit 0 of 8 bytes with one multiply, see pack_row()
+        uint64_t v;
+        memcpy(&v,p+j,8);
+        if (v){
+          v = ((v & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+          r[j>>6] |= v << (j&63);
+        }
+      }
+    #endif
+      for (; j < w; j++){
+        r[j>>6] |= (uint64_t)(p[j] & 1) << (j&63);
+      }
+      int* c = occ.rsum+i*(nw+1);
+      c[0] = 0;
+      for (int k = 0; k < nw; k++){
+        c[k+1] = c[k]+__builtin_popcountll(r[k]);
+      }
+    }
+    // 8x8 blocks: occupancy, and transposed (8x8 bit transpose) into the columns
+    for (int by = 0; by < h8; by++){
+      for (int k = 0; k < nw; k++){
+        uint64_t any = 0;
+        for (int i = by*8; i < std::min(h,by*8+8); i++){
+          any |= occ.rows[i*nw+k];
+        }
+        if (!any){
+          continue;
+        }
+        for (int bx = k*8; bx < std::min(w8,k*8+8); bx++){
+          uint64_t t, v = 0;
+          for (int i = by*8; i < std::min(h,by*8+8); i++){
+            v |= ((occ.rows[i*nw+k] >> ((bx&7)*8)) & 0xff) << ((i&7)*8);
+          }
+          if (!v){
+            continue;
+          }
+          occ.b8[by*w8+bx] = 1;
+          occ.b64[(by>>3)*nw+k] = 1;
+          t = (v ^ (v >> 7)) & 0x00AA00AA00AA00AAULL; v = v ^ t ^ (t << 7);
+          t = (v ^ (v >> 14)) & 0x0000CCCC0000CCCCULL; v = v ^ t ^ (t << 14);
+          t = (v ^ (v >> 28)) & 0x00000000F0F0F0F0ULL; v = v ^ t ^ (t << 28);
+          for (int j = bx*8; j < std::min(w,bx*8+8); j++){
+            occ.cols[j*nh+(by>>3)] |= ((v >> ((j&7)*8)) & 0xff) << ((by&7)*8);
+          }
+        }
+      }
+    }
+    for (int j = 0; j < w; j++){
+      const uint64_t* r = occ.cols+j*nh;
+      int* c = occ.csum+j*(nh+1);
+      c[0] = 0;
+      for (int k = 0; k < nh; k++){
+        c[k+1] = c[k]+__builtin_popcountll(r[k]);
+      }
+    }
+  }
+
+  void destroy_occupancy(){
+    free(occ.rows);
+    free(occ.cols);
+    free(occ.rsum);
+    free(occ.csum);
+    free(occ.b8);
+    free(occ.b64);
+    occ.rows = NULL;
+    occ.cols = NULL;
+    occ.rsum = NULL;
+    occ.csum = NULL;
+    occ.b8 = NULL;
+    occ.b64 = NULL;
+  }
+
+  // white pixels from bit n0 to n1-1 of a packed line (bits b, running counts c)
+  static inline int count_span(const uint64_t* b, const int* c, int n0, int n1){
+    int k0 = n0>>6, k1 = n1>>6;
+    uint64_t m0 = ((uint64_t)1 << (n0&63))-1;
+    uint64_t m1 = ((uint64_t)1 << (n1&63))-1;
+    if (k0 == k1){
+      return __builtin_popcountll(b[k0] & (m1 ^ m0));
+    }
+    return c[k1]-c[k0]+__builtin_popcountll(b[k1] & m1)-__builtin_popcountll(b[k0] & m0);
+  }
+
+  // number of white pixels in row i from column x0 to x1-1
+  inline int white_in_row(int i, int x0, int x1){
+    if (!occ.rows){
+      int s = 0;
+      for (int j = x0; j < x1; j++){
+        s += im[i*W+j]?1:0;
+      }
+      return s;
+    }
+    return count_span(occ.rows+(i-occ.y)*occ.nw,occ.rsum+(i-occ.y)*(occ.nw+1),x0-occ.x,x1-occ.x);
+  }
+
+  // number of white pixels in column j from row y0 to y1-1
+  inline int white_in_col(int j, int y0, int y1){
+    if (!occ.rows){
+      int s = 0;
+      for (int i = y0; i < y1; i++){
+        s += im[i*W+j]?1:0;
+      }
+      return s;
+    }
+    return count_span(occ.cols+(j-occ.x)*occ.nh,occ.csum+(j-occ.x)*(occ.nh+1),y0-occ.y,y1-occ.y);
+  }
+
+  // does a region inside the occupancy tables have any white pixel? Only
+  // occupied 8x8 blocks in occupied 64x64 blocks are looked at
+  int occ_not_empty(int x, int y, int w, int h){
+    int bx0 = (x-occ.x)>>3, bx1 = (x+w-1-occ.x)>>3;
+    int by0 = (y-occ.y)>>3, by1 = (y+h-1-occ.y)>>3;
+    for (int Y = by0>>3; Y <= by1>>3; Y++){
+      for (int X = bx0>>3; X <= bx1>>3; X++){
+        if (!occ.b64[Y*occ.nw+X]){
+          continue;
+        }
+        for (int by = std::max(by0,Y*8); by <= std::min(by1,Y*8+7); by++){
+          for (int bx = std::max(bx0,X*8); bx <= std::min(bx1,X*8+7); bx++){
+            if (!occ.b8[by*occ.w8+bx]){
+              continue;
+            }
+            int i0 = std::max(y,occ.y+by*8), i1 = std::min(y+h,occ.y+by*8+8);
+            int j0 = std::max(x,occ.x+bx*8), j1 = std::min(x+w,occ.x+bx*8+8);
+            if (i1-i0 == 8 && j1-j0 == 8){ // the whole block is inside
+              return 1;
+            }
+            // an 8x8 block lies within one word of each row
+            const uint64_t* r = occ.rows+(i0-occ.y)*occ.nw+((j0-occ.x)>>6);
+            uint64_t m = (((uint64_t)1 << (j1-j0))-1) << ((j0-occ.x)&63);
+            for (int i = i0; i < i1; i++, r += occ.nw){
+              if (*r & m){
+                return 1;
+              }
+            }
+          }
+        }
+      }
+    }
+    return 0;
+  }
+
+  // check if a region has any white pixel
+  int not_empty(int x, int y, int w, int h){
+    if (occ.rows){
+      return occ_not_empty(x,y,w,h);
+    }
+    for (int i = y; i < y+h; i++){
+      for (int j = x; j < x+w; j++){
+        if (im[i*W+j]){
+          return 1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  /**merge ith fragment of second chunk to first chunk
+   * @param c0   fragments from  first  chunk
+   * @param c1i  ith fragment of second chunk
+   * @param sx   (x or y) coordinate of the seam
+   * @param isv  is vertical, not horizontal?
+   * @param mode 2-bit flag, 
+   *             MSB = is matching the left (not right) end of the fragment from first  chunk
+   *             LSB = is matching the right (not left) end of the fragment from second chunk
+   * @return     matching successful?             
+   */
+  int merge_impl(polyline_t* c0, polyline_t* c1i, int sx, int isv, int mode){
+    int b0 = (mode >> 1 & 1)>0; // match c0 left
+    int b1 = (mode >> 0 & 1)>0; // match c1 left
+    polyline_t* c0j = NULL;
+    int md = params.merge_dist; // maximum offset to be regarded as continuous
+
+    point_t* p1 = b1 ? c1i->head : c1i->tail;
+
+    if (abs((isv?(p1->y):(p1->x))-sx)>0){ // not on the seam, skip
+      return 0;
+    }
+    // find the best match
+    polyline_t* it = c0;
+    while (it){
+      point_t* p0 = b0?(it->head):(it->tail);
+      if (abs((isv?(p0->y):(p0->x))-sx)>1){ // not on the seam, skip
+        it = it->next;
+        continue;
+      }
+      int d = abs((isv?(p0->x):(p0->y)) - (isv?(p1->x):(p1->y)));
+      if (d < md){
+        c0j = it;
+        md = d;
+      }
+      it = it->next;
+    }
+
+    if (c0j){ // best match is good enough, merge them
+      if (b0 && b1){
+        reverse_polyline(c1i);
+        cat_head_polyline(c0j,c1i);
+      }else if (!b0 && b1){
+        cat_tail_polyline(c0j,c1i);
+      }else if (b0 && !b1){
+        cat_head_polyline(c0j,c1i);
+      }else {
+        reverse_polyline(c1i);
+        cat_tail_polyline(c0j,c1i);
+      }
+      return 1;    
+    }
+    return 0;
+  }
+
+  // Endpoint index for merge_frags(): the ends of the first chunk's
+  // fragments that lie within 1px of the seam, in buckets by their
+  // coordinate along the seam, so merge_impl() only looks at the buckets
+  // within the md < merge_dist range instead of walking the whole list. Entry
+  // end*n+k is the tail (end 0) or head (end 1) of the kth fragment; ties
+  // are broken by k, which is what the list walk does.
+  typedef struct _seam_index_t {
+    int n;              // number of fragments
+    polyline_t** q;     // the fragments, in list order
+    int lo;             // along-seam coordinate of the first bucket
+    int len;            // buckets per end
+    int* bucket;        // first entry of each bucket, tails then heads, -1 = empty
+    int* key;           // bucket of each entry, -1 = not near the seam
+    int* prev;          // doubly linked bucket lists
+    int* next;
+  } seam_index_t;
+
+  // move entry e to the bucket of point p
+  void seam_index_set(seam_index_t* ix, int e, point_t* p, int sx, int isv){
+    int* b = ix->bucket;
+    if (ix->key[e] >= 0){ // unlink
+      if (ix->prev[e] >= 0){
+        ix->next[ix->prev[e]] = ix->next[e];
+      }else{
+        b[ix->key[e]] = ix->next[e];
+      }
+      if (ix->next[e] >= 0){
+        ix->prev[ix->next[e]] = ix->prev[e];
+      }
+      ix->key[e] = -1;
+    }
+    if (abs((isv?(p->y):(p->x))-sx)>1){ // not on the seam
+      return;
+    }
+    int k = (e >= ix->n)*ix->len + (isv?(p->x):(p->y)) - ix->lo;
+    ix->key[e] = k;
+    ix->prev[e] = -1;
+    ix->next[e] = b[k];
+    if (b[k] >= 0){
+      ix->prev[b[k]] = e;
+    }
+    b[k] = e;
+  }
+
+  /**index the endpoints of c0 near the seam
+   * @param c0   fragments from first  chunk
+   * @param c1   fragments from second chunk (their ends bound the coordinates to index)
+   * @param sx   (x or y) coordinate of the seam
+   * @param isv  is vertical, not horizontal?
    */
-  polyline_t* chunk_to_frags(int x, int y, int w, int h){
+  void seam_index_build(seam_index_t* ix, polyline_t* c0, polyline_t* c1, int sx, int isv){
+    int n = 0;
+    int lo = INT_MAX, hi = INT_MIN;
+    for (int c = 0; c < 2; c++){
+      for (polyline_t* it = c ? c1 : c0; it; it = it->next){
+        n += !c;
+        int a0 = isv?(it->head->x):(it->head->y);
+        int a1 = isv?(it->tail->x):(it->tail->y);
+        lo = std::min(lo,std::min(a0,a1));
+        hi = std::max(hi,std::max(a0,a1));
+      }
+    }
+    ix->n = n;
+    ix->lo = lo;
+    ix->len = hi-lo+1;
+    ix->q = (polyline_t**)malloc(sizeof(polyline_t*)*n);
+    ix->bucket = (int*)malloc(sizeof(int)*ix->len*2);
+    ix->key = (int*)malloc(sizeof(int)*n*6); // 2n entries each
+    ix->prev = ix->key+n*2;
+    ix->next = ix->key+n*4;
+    for (int k = 0; k < ix->len*2; k++){
+      ix->bucket[k] = -1;
+    }
+    int k = 0;
+    for (polyline_t* it = c0; it; it = it->next){
+      ix->q[k++] = it;
+    }
+    for (k = 0; k < n; k++){
+      ix->key[k] = ix->key[n+k] = -1;
+      seam_index_set(ix,k,ix->q[k]->tail,sx,isv);
+      seam_index_set(ix,n+k,ix->q[k]->head,sx,isv);
+    }
+  }
+
+  void seam_index_free(seam_index_t* ix){
+    free(ix->q);
+    free(ix->bucket);
+    free(ix->key);
+  }
+
+  /**merge_impl() looking up the candidates in an index of c0
+   * @param ix   index of the fragments from first chunk
+   * @param c1i  ith fragment of second chunk
+   * @param sx   (x or y) coordinate of the seam
+   * @param isv  is vertical, not horizontal?
+   * @param mode see merge_impl()
+   * @return     matching successful?
+   */
+  int merge_indexed(seam_index_t* ix, polyline_t* c1i, int sx, int isv, int mode){
+    int b0 = (mode >> 1 & 1)>0; // match c0 left
+    int b1 = (mode >> 0 & 1)>0; // match c1 left
+    int md = params.merge_dist; // maximum offset to be regarded as continuous
+    int me = -1;
+
+    point_t* p1 = b1 ? c1i->head : c1i->tail;
+
+    if (abs((isv?(p1->y):(p1->x))-sx)>0){ // not on the seam, skip
+      return 0;
+    }
+    int a1 = isv?(p1->x):(p1->y);
+    int a0 = std::max(a1-md+1,ix->lo);
+    int a2 = std::min(a1+md-1,ix->lo+ix->len-1);
+    for (int a = a0; a <= a2; a++){
+      for (int e = ix->bucket[b0*ix->len+a-ix->lo]; e >= 0; e = ix->next[e]){
+        int d = abs(a-a1);
+        if (d < md || (d == md && e < me)){
+          md = d;
+          me = e;
+        }
+      }
+    }
+    if (me < 0){
+      return 0;
+    }
+    polyline_t* c0j = ix->q[me-b0*ix->n];
+    if (b0 && b1){
+      reverse_polyline(c1i);
+      cat_head_polyline(c0j,c1i);
+    }else if (!b0 && b1){
+      cat_tail_polyline(c0j,c1i);
+    }else if (b0 && !b1){
+      cat_head_polyline(c0j,c1i);
+    }else {
+      reverse_polyline(c1i);
+      cat_tail_polyline(c0j,c1i);
+    }
+    seam_index_set(ix,me,b0?c0j->head:c0j->tail,sx,isv);
+    return 1;
+  }
+
+  // merge_indexed() if there is an index, else merge_impl()
+  int merge_one(polyline_t* c0, seam_index_t* ix, polyline_t* c1i, int sx, int isv, int mode){
+    return ix ? merge_indexed(ix,c1i,sx,isv,mode) : merge_impl(c0,c1i,sx,isv,mode);
+  }
+
+  /**merge fragments from two chunks; the unmatched fragments of c1 end up
+   * in front of c0's, last one first, spliced on in O(1)
+   * @param c0   fragments from first  chunk, receives the result
+   * @param c1   fragments from second chunk, left empty
+   * @param sx   (x or y) coordinate of the seam
+   * @param dr   merge direction, HORIZONTAL or VERTICAL?
+   */
+  void merge_frag_lists(frag_list_t* c0, frag_list_t* c1, int sx, int dr){
+    if (!c0->head || !c1->head){
+      cat_frags(c0,c1);
+      return;
+    }
+    int isv = dr != HORIZONTAL;
+    seam_index_t ix;
+    seam_index_t* pix = NULL;
+    if (c0->size >= MERGE_INDEX_MIN){ // many candidates, look them up by seam coordinate
+      seam_index_build(&ix,c0->head,c1->head,sx,isv);
+      pix = &ix;
+    }
+    frag_list_t rest = {NULL,NULL,0};
+    polyline_t* it = c1->head;
+    while(it){
+      polyline_t* tmp = it->next;
+      if (merge_one(c0->head,pix,it,sx,isv,1) ||
+          merge_one(c0->head,pix,it,sx,isv,3) ||
+          merge_one(c0->head,pix,it,sx,isv,0) ||
+          merge_one(c0->head,pix,it,sx,isv,2)){
+        free(it);
+      }else{
+        push_frag(&rest,it);
+      }
+      it = tmp;
+    }
+    if (pix){
+      seam_index_free(pix);
+    }
+    cat_frags(&rest,c0);
+    *c0 = rest;
+    c1->head = NULL;
+    c1->tail = NULL;
+    c1->size = 0;
+  }
+
+  /**merge fragments from two chunks
+   * @param c0   fragments from first  chunk
+   * @param c1   fragments from second chunk
+   * @param sx   (x or y) coordinate of the seam
+   * @param dr   merge direction, HORIZONTAL or VERTICAL?
+   */
+  polyline_t* merge_frags(polyline_t* c0, polyline_t* c1, int sx, int dr){
+    frag_list_t l0 = frag_list(c0);
+    frag_list_t l1 = frag_list(c1);
+    merge_frag_lists(&l0,&l1,sx,dr);
+    return l0.head;
+  }
+
+  // chunk_to_frags() on the bytes of the image, any chunk size
+  polyline_t* chunk_to_frags_bytes(int x, int y, int w, int h){
     polyline_t* frags = NULL;
     int fsize = 0;
     int on = 0; // to deal with strokes thicker than 1px
@@ -473,49 +2162,594 @@ struct skeleton_tracer_t {
           on = 0;
         }
       }
-      li = i;
-      lj = j;
+      li = i;
+      lj = j;
+    }
+    if (fsize == 2){ // probably just a line, connect them
+      polyline_t* f = new_polyline();
+      add_point_to_polyline(f,frags->head->x,frags->head->y);
+      add_point_to_polyline(f,frags->next->head->x,frags->next->head->y);
+      destroy_polylines(frags);
+      frags = f;
+    }else if (fsize > 2){ // it's a crossroad, guess the intersection
+      int ms = 0;
+      int mi = -1;
+      int mj = -1;
+      // use convolution to find brightest blob
+      for (int i = y+1; i < y+h-1; i++){
+        for (int j = x+1; j < x+w-1; j++){
+          int s = 
+            (im[i*W-W+j-1]) + (im[i*W-W+j]) + (im[i*W-W+j-1+1])+
+            (im[i*W+j-1]  ) +   (im[i*W+j]) +   (im[i*W+j+1]  )+
+            (im[i*W+W+j-1]) + (im[i*W+W+j]) + (im[i*W+W+j+1]  );
+          if (s > ms){
+            mi = i;
+            mj = j;
+            ms = s;
+          }else if (s == ms && abs(j-(x+w/2))+abs(i-(y+h/2)) < abs(mj-(x+w/2))+abs(mi-(y+h/2))){
+            mi = i;
+            mj = j;
+            ms = s;
+          }
+        }
+      }
+      if (mi != -1){
+        polyline_t* it = frags;
+        while(it){
+          it->tail->x = mj;
+          it->tail->y = mi;
+          it = it->next;
+        }
+      }
+    }
+    return frags;
+  }
+
+  // Bit-packed leaf: the same fragments as chunk_to_frags_bytes() on a 0/1
+  // image, for chunks of 2x2 up to 16x16. Row r of the chunk is a 16-bit
+  // mask (bit b = column x+b); the border, read clockwise from the top left
+  // like chunk_to_frags_bytes() walks it, is one 64-bit mask (at most 60
+  // pixels), whose runs of set bits are the outgoing strokes. The 3x3 sums
+  // of the crossroad heuristic are popcounts of three rows side by side.
+
+  // reverse the lowest n bits of v (n <= 16)
+  static uint64_t reverse_bits(uint64_t v, int n){
+    v = ((v & 0x5555) << 1) | ((v >> 1) & 0x5555);
+    v = ((v & 0x3333) << 2) | ((v >> 2) & 0x3333);
+    v = ((v & 0x0f0f) << 4) | ((v >> 4) & 0x0f0f);
+    v = ((v & 0x00ff) << 8) | ((v >> 8) & 0x00ff);
+    return v >> (16-n);
+  }
+
+  // chunk coordinates (i,j) of the kth pixel of the clockwise border walk
+  static void chunk_border_pixel(int w, int h, int k, int* i, int* j){
+    if (k < w){
+      *i = 0; *j = k;
+    }else if (k < w+h-1){
+      *i = k-w+1; *j = w-1;
+    }else if (k < w+h+w-2){
+      *i = h-1; *j = w-(k-w-h+3);
+    }else{
+      *i = h-(k-w-h-w+4); *j = 0;
+    }
+  }
+
+  // pixels p[0..w-1] of the image (w <= 16) as a bitmask
+  uint64_t pack_row(const uchar* p, int w){
+  #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (p+16 <= im+W*H){ // 8 pixels per multiply, which gathers bit 0 of every byte into the top byte
+      uint64_t a, b;
+      memcpy(&a,p,8);
+      memcpy(&b,p+8,8);
+      a = ((a & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+      b = ((b & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+      return (a | b << 8) & (((uint64_t)1 << w)-1);
+    }
+  #endif
+    uint64_t r = 0;
+    for (int j = 0; j < w; j++){
+      r |= (uint64_t)(p[j] & 1) << j;
+    }
+    return r;
+  }
+
+  polyline_t* chunk_to_frags_bits(int x, int y, int w, int h){
+    const uchar* p0 = im+y*W+x;
+    uint64_t top = pack_row(p0,w);
+    uint64_t bottom = pack_row(p0+(h-1)*W,w);
+    uint64_t left = 0, right = 0; // first and last column, bit i-1 = row i
+    for (int i = 1; i < h-1; i++){
+      const uchar* p = p0+i*W;
+      left  |= (uint64_t)(p[0] & 1) << (i-1);
+      right |= (uint64_t)(p[w-1] & 1) << (i-1);
+    }
+    right |= (bottom >> (w-1)) << (h-2);
+    int n = w+h+w+h-4;
+    uint64_t border = top                                             // top, left to right
+      | right << w                                                    // right, top to bottom
+      | reverse_bits(bottom & (((uint64_t)1 << (w-1))-1), w-1) << (w+h-1) // bottom, right to left
+      | reverse_bits(left, h-2) << (w+h+w-2);                         // left, bottom to top
+
+    polyline_t* frags = NULL;
+    int fsize = 0;
+    int k = 0;
+    while (k < n && (border >> k)){
+      int a = k + __builtin_ctzll(border >> k);      // first pixel of the run
+      int b = a + __builtin_ctzll(~(border >> a));   // one past its last
+      int ai, aj;
+      chunk_border_pixel(w,h,a,&ai,&aj);
+      polyline_t* f = new_polyline();
+      if (b < n){ // right side of stroke, average to get center of stroke
+        int bi, bj;
+        chunk_border_pixel(w,h,b-1,&bi,&bj);
+        add_point_to_polyline(f, (x+aj+x+bj)/2, (y+ai+y+bi)/2);
+      }else{
+        add_point_to_polyline(f, x+aj, y+ai);
+      }
+      add_point_to_polyline(f, x+w/2,y+h/2);
+      frags = prepend_polyline(frags,f);
+      fsize ++;
+      k = b;
+    }
+    if (fsize == 2){ // probably just a line, connect them
+      polyline_t* f = new_polyline();
+      add_point_to_polyline(f,frags->head->x,frags->head->y);
+      add_point_to_polyline(f,frags->next->head->x,frags->next->head->y);
+      destroy_polylines(frags);
+      frags = f;
+    }else if (fsize > 2){ // it's a crossroad, guess the intersection
+      int ms = 0;
+      int mi = -1;
+      int mj = -1;
+      // brightest 3x3 blob: three rows side by side in one word, one popcount
+      // per pixel (the kernel of chunk_to_frags_bytes() counts the top middle
+      // pixel twice and the top right one not at all, and so does this one)
+      uint64_t row[16];
+      for (int i = 0; i < h; i++){
+        row[i] = pack_row(p0+i*W,w);
+      }
+      for (int i = 1; i < h-1; i++){
+        uint64_t rows = row[i-1] | row[i] << 16 | row[i+1] << 32;
+        for (int j = 1; j < w-1; j++){
+          uint64_t r = rows >> (j-1);
+          int s = __builtin_popcountll(r & 0x700070003ULL) + (int)((r >> 1) & 1);
+          int ci = y+i, cj = x+j;
+          if (s > ms){
+            mi = ci;
+            mj = cj;
+            ms = s;
+          }else if (s == ms && abs(cj-(x+w/2))+abs(ci-(y+h/2)) < abs(mj-(x+w/2))+abs(mi-(y+h/2))){
+            mi = ci;
+            mj = cj;
+            ms = s;
+          }
+        }
+      }
+      if (mi != -1){
+        polyline_t* it = frags;
+        while(it){
+          it->tail->x = mj;
+          it->tail->y = mi;
+          it = it->next;
+        }
+      }
+    }
+    return frags;
+  }
+
+  // Leaf cache: the fragments of a leaf only depend on its pixels and size
+  // (they move along with the chunk), so with LEAF_CACHE they are stored
+  // relative to the chunk origin, keyed by the packed pixels, and a leaf
+  // seen before is only a translated copy. Direct mapped, LEAF_CACHE_SLOTS
+  // entries, a new leaf evicts whatever was in its slot. The slots are
+  // guarded by a few striped locks so that all tracing threads (and the
+  // tracers of trace_components()) can share one cache.
+
+  #define LEAF_CACHE_FRAGS 30 // most fragments of a 16x16 leaf: runs on a 60 pixel border
+  #define LEAF_CACHE_LOCKS 64
+
+  typedef struct _leaf_entry_t {
+    uint64_t bits[4]; // rows of the chunk, 16 bits apart
+    uchar w, h;       // 0 = empty slot
+    uchar n;          // number of fragments, 2 points each
+    uchar pts[LEAF_CACHE_FRAGS*4]; // x0,y0,x1,y1 of every fragment in list order, relative to the chunk
+  } leaf_entry_t;
+
+  struct leaf_cache_t {
+    leaf_entry_t* slots;
+    long long lookups[LEAF_CACHE_LOCKS]; // per lock, so they can be counted under it
+    long long hits[LEAF_CACHE_LOCKS];
+  #if USE_THREADS
+    std::mutex locks[LEAF_CACHE_LOCKS];
+  #endif
+  };
+
+  void init_leaf_cache(){
+    if (leaf_cache){
+      return;
+    }
+    leaf_cache = new leaf_cache_t();
+    leaf_cache->slots = (leaf_entry_t*)calloc(LEAF_CACHE_SLOTS, sizeof(leaf_entry_t));
+    for (int k = 0; k < LEAF_CACHE_LOCKS; k++){
+      leaf_cache->lookups[k] = 0;
+      leaf_cache->hits[k] = 0;
+    }
+  }
+
+  void destroy_leaf_cache(){
+    if (!leaf_cache){
+      return;
+    }
+    free(leaf_cache->slots);
+    delete leaf_cache;
+    leaf_cache = NULL;
+  }
+
+  /**hit-rate statistics of the leaf cache, since it was created
+   * @param lookups  receives the number of leaves looked up
+   * @param hits     receives how many of them were found
+   */
+  void leaf_cache_stats(long long* lookups, long long* hits){
+    *lookups = 0;
+    *hits = 0;
+    if (!leaf_cache){
+      return;
+    }
+    for (int k = 0; k < LEAF_CACHE_LOCKS; k++){
+    #if USE_THREADS
+      std::lock_guard<std::mutex> lock(leaf_cache->locks[k]);
+    #endif
+      *lookups += leaf_cache->lookups[k];
+      *hits += leaf_cache->hits[k];
+    }
+  }
+
+  // chunk_to_frags() through the leaf cache, for chunks of 2x2 up to 16x16
+  polyline_t* chunk_to_frags_cached(int x, int y, int w, int h){
+    leaf_entry_t key;
+    key.bits[0] = key.bits[1] = key.bits[2] = key.bits[3] = 0;
+    key.w = w;
+    key.h = h;
+    uint64_t hash = (uint64_t)(w*17+h);
+    for (int i = 0; i < h; i++){
+      key.bits[i>>2] |= pack_row(im+(y+i)*W+x,w) << ((i&3)*16);
+    }
+    for (int k = 0; k < 4; k++){
+      hash = (hash ^ key.bits[k]) * 0x9e3779b97f4a7c15ULL;
+      hash ^= hash >> 29;
+    }
+    int slot = (int)(hash % LEAF_CACHE_SLOTS);
+    int stripe = slot % LEAF_CACHE_LOCKS;
+    leaf_entry_t* e = &leaf_cache->slots[slot];
+    polyline_t* frags = NULL;
+    {
+    #if USE_THREADS
+      std::lock_guard<std::mutex> lock(leaf_cache->locks[stripe]);
+    #endif
+      leaf_cache->lookups[stripe]++;
+      if (e->w == w && e->h == h && !memcmp(e->bits,key.bits,sizeof(key.bits))){
+        leaf_cache->hits[stripe]++;
+        for (int f = e->n-1; f >= 0; f--){
+          const uchar* p = e->pts+f*4;
+          polyline_t* q = new_polyline();
+          add_point_to_polyline(q,x+p[0],y+p[1]);
+          add_point_to_polyline(q,x+p[2],y+p[3]);
+          frags = prepend_polyline(frags,q);
+        }
+        return frags;
+      }
+    }
+  #if LEAF_BITS
+    frags = chunk_to_frags_bits(x,y,w,h);
+  #else
+    frags = chunk_to_frags_bytes(x,y,w,h);
+  #endif
+    key.n = 0;
+    for (polyline_t* it = frags; it; it = it->next){
+      uchar* p = key.pts+key.n*4;
+      p[0] = it->head->x-x;
+      p[1] = it->head->y-y;
+      p[2] = it->tail->x-x;
+      p[3] = it->tail->y-y;
+      key.n++;
+    }
+    {
+    #if USE_THREADS
+      std::lock_guard<std::mutex> lock(leaf_cache->locks[stripe]);
+    #endif
+      *e = key;
+    }
+    return frags;
+  }
+
+  /**recursive bottom: turn chunk into polyline fragments;
+   * look around on 4 edges of the chunk, and identify the "outgoing" pixels;
+   * add segments connecting these pixels to center of chunk;
+   * apply heuristics to adjust center of chunk
+   *
+   * @param x    left of   chunk
+   * @param y    top of    chunk
+   * @param w    width of  chunk
+   * @param h    height of chunk
+   * @return     the polyline fragments
+   */
+  polyline_t* chunk_to_frags(int x, int y, int w, int h){
+    if (w >= 2 && h >= 2 && w <= 16 && h <= 16){
+    #if LEAF_CACHE
+      if (leaf_cache){
+        return chunk_to_frags_cached(x,y,w,h);
+      }
+    #endif
+    #if LEAF_BITS
+      return chunk_to_frags_bits(x,y,w,h);
+    #endif
+    }
+    return chunk_to_frags_bytes(x,y,w,h);
+  }
+
+
+  /**is a chunk simple enough to be a leaf whatever its size? It is if the
+   * border walk of chunk_to_frags() finds exactly two outgoing strokes, so
+   * that the leaf is the segment between them, and every white pixel in the
+   * chunk lies within 1px of that segment: one straight stroke across the
+   * chunk and nothing else, which splitting would only cut into pieces to be
+   * merged back. Curves, branches and anything not reaching the border
+   * (which a leaf would lose) keep the chunk splitting.
+   * @param x    left of   chunk
+   * @param y    top of    chunk
+   * @param w    width of  chunk (at most 64)
+   * @param h    height of chunk
+   * @return     1 if the chunk can be a leaf
+   */
+  int simple_chunk(int x, int y, int w, int h){
+    if (w < 3 || h < 3 || w > 64){
+      return 0;
+    }
+    int n = w+h+w+h-4;
+    int runs = 0, on = 0;
+    int px[2], py[2]; // ends of the two strokes, placed like chunk_to_frags() does
+    int li = -1, lj = -1;
+    for (int k = 0; k < n; k++){
+      int i, j;
+      chunk_border_pixel(w,h,k,&i,&j);
+      i += y;
+      j += x;
+      if (im[i*W+j]){
+        if (!on){
+          if (runs == 2){
+            return 0;
+          }
+          px[runs] = j;
+          py[runs] = i;
+          runs++;
+          on = 1;
+        }
+      }else if (on){ // average with the last pixel of the run
+        px[runs-1] = (px[runs-1]+lj)/2;
+        py[runs-1] = (py[runs-1]+li)/2;
+        on = 0;
+      }
+      li = i;
+      lj = j;
+    }
+    if (runs != 2){
+      return 0;
+    }
+    long long dx = px[1]-px[0], dy = py[1]-py[0];
+    long long len2 = dx*dx+dy*dy;
+    if (!len2){
+      return 0;
+    }
+    for (int i = y; i < y+h; i++){
+      uint64_t v = 0; // the row of the chunk, bit b = column x+b
+      if (occ.rows){
+        const uint64_t* r = occ.rows+(i-occ.y)*occ.nw;
+        int b = x-occ.x;
+        v = r[b>>6] >> (b&63);
+        if ((b&63) && (b>>6)+1 < occ.nw){
+          v |= r[(b>>6)+1] << (64-(b&63));
+        }
+        if (w < 64){
+          v &= ((uint64_t)1 << w)-1;
+        }
+      }else{
+        for (int j = 0; j < w; j++){
+          v |= (uint64_t)(im[i*W+x+j] & 1) << j;
+        }
+      }
+      while (v){
+        int j = x+__builtin_ctzll(v);
+        long long c = dx*(i-py[0])-dy*(j-px[0]); // distance to the line, times its length
+        long long t = dx*(j-px[0])+dy*(i-py[0]); // position along it, times its length
+        if (c*c > len2 || (t < 0 && t*t > len2) || (t > len2 && (t-len2)*(t-len2) > len2)){
+          return 0;
+        }
+        v &= v-1;
+      }
+    }
+    return 1;
+  }
+
+  // is the chunk a recursive bottom: small enough, or simple_chunk()
+  int is_leaf(int x, int y, int w, int h){
+    if (w <= params.chunk_size && h <= params.chunk_size){
+      return 1;
+    }
+    return w <= params.simple_leaf_size && h <= params.simple_leaf_size && simple_chunk(x,y,w,h);
+  }
+
+
+  /**split_chunk() with SPLIT_BALANCED: of the seams with the fewest white
+   * pixels, take the one that leaves the most even number of white pixels
+   * on its two sides (then the one nearest the middle), so that the two
+   * halves are about the same amount of work for the parallel tracer even
+   * when the ink sits on one side of the chunk. All candidates are scored,
+   * with the running foreground count on one side, in O(w+h). Only the
+   * chunks trace_skeleton_task() shares out are split this way; serial
+   * tracing keeps split_chunk().
+   */
+  int split_chunk_balanced(int x, int y, int w, int h, rect_t* L, rect_t* R, int* sx){
+    int ms = INT_MAX, mb = INT_MAX; // white pixels on the seam, and imbalance of the halves
+    int mi = -1;
+    int mj = -1;
+    int total = 0;
+    int* rows = (int*)malloc(sizeof(int)*h); // white pixels of every row
+    for (int i = 0; i < h; i++){
+      rows[i] = white_in_row(y+i,x,x+w);
+      total += rows[i];
+    }
+    if (h > params.chunk_size){
+      int mid = y+h/2;
+      int above = 0; // white pixels above the seam
+      for (int i = y+1; i < y+h-3; i++){
+        above += rows[i-1-y];
+        if (i >= y+3 && !(im[i*W+x] ||im[(i-1)*W+x] ||im[i*W+x+w-1] ||im[(i-1)*W+x+w-1])){
+          int s = rows[i-1-y]+rows[i-y];
+          int b = abs(2*above-total);
+          if (s < ms || (s == ms && (b < mb || (b == mb && abs(i-mid) < abs(mi-mid))))){
+            ms = s; mb = b; mi = i;
+          }
+        }
+      }
+    }
+    free(rows);
+    if (w > params.chunk_size){
+      int mid = x+w/2;
+      int mv = INT_MAX, bv = INT_MAX;
+      int left = 0, prev = 0;
+      for (int j = x; j < x+w-3; j++){
+        int r = white_in_col(j,y,y+h);
+        if (j >= x+3 && !(im[W*y+j]||im[W*(y+h)-W+j]||im[W*y+j-1]||im[W*(y+h)-W+j-1])){
+          int s = prev+r;
+          int b = abs(2*left-total);
+          if (s < mv || (s == mv && (b < bv || (b == bv && abs(j-mid) < abs(mj-mid))))){
+            mv = s; bv = b; mj = j;
+          }
+        }
+        left += r;
+        prev = r;
+      }
+      if (mj != -1 && (mv < ms || (mv == ms && bv <= mb))){
+        mi = -1;
+      }else{
+        mj = -1;
+      }
     }
-    if (fsize == 2){ // probably just a line, connect them
-      polyline_t* f = new_polyline();
-      add_point_to_polyline(f,frags->head->x,frags->head->y);
-      add_point_to_polyline(f,frags->next->head->x,frags->next->head->y);
-      destroy_polylines(frags);
-      frags = f;
-    }else if (fsize > 2){ // it's a crossroad, guess the intersection
-      int ms = 0;
-      int mi = -1;
-      int mj = -1;
-      // use convolution to find brightest blob
-      for (int i = y+1; i < y+h-1; i++){
-        for (int j = x+1; j < x+w-1; j++){
-          int s = 
-            (im[i*W-W+j-1]) + (im[i*W-W+j]) + (im[i*W-W+j-1+1])+
-            (im[i*W+j-1]  ) +   (im[i*W+j]) +   (im[i*W+j+1]  )+
-            (im[i*W+W+j-1]) + (im[i*W+W+j]) + (im[i*W+W+j+1]  );
-          if (s > ms){
-            mi = i;
-            mj = j;
-            ms = s;
-          }else if (s == ms && abs(j-(x+w/2))+abs(i-(y+h/2)) < abs(mj-(x+w/2))+abs(mi-(y+h/2))){
-            mi = i;
-            mj = j;
-            ms = s;
+    if (mi != -1){
+      L->x = x; L->y = y;  L->w = w; L->h = mi-y;
+      R->x = x; R->y = mi; R->w = w; R->h = y+h-mi;
+      *sx = mi;
+      return VERTICAL;
+    }else if (mj != -1){
+      L->x = x; L->y = y; L->w = mj-x; L->h = h;
+      R->x = mj;R->y = y; R->w = x+w-mj;R->h = h;
+      *sx = mj;
+      return HORIZONTAL;
+    }
+    return 0;
+  }
+
+  /**find the best "seam" to split a chunk along (step 2 of trace_skeleton())
+   * @param x    left of   chunk
+   * @param y    top of    chunk
+   * @param w    width of  chunk
+   * @param h    height of chunk
+   * @param L    receives the first  half
+   * @param R    receives the second half
+   * @param sx   receives the (x or y) coordinate of the seam
+   * @return     merge direction, HORIZONTAL or VERTICAL; 0 if splitting failed
+   */
+  int split_chunk(int x, int y, int w, int h, rect_t* L, rect_t* R, int* sx){
+    int ms = INT_MAX; // number of white pixels on the seam, less the better
+    int mi = -1; // horizontal seam candidate
+    int mj = -1; // vertical   seam candidate
+
+    // Candidates are tried from the middle outwards, the upper/left one
+    // first at equal distance, so the first one with the lowest score is the
+    // seam (if there is a draw, which is very common, we want the seam to be
+    // near the middle to balance the divide and conquer tree), and an empty
+    // one ends the search. In blank areas that is right at the middle.
+    // A seam is 2px wide: each step outwards reaches one new row (column),
+    // the other one is the last row (column) counted on that side.
+    // With params.seam_window only the candidates up to that far from the
+    // middle are scored, unless none of them can be a seam.
+    int window = params.seam_window > 0 ? params.seam_window : INT_MAX;
+    if (h > params.chunk_size){ // try splitting top and bottom
+      int mid = y+h/2;
+      int up = white_in_row(mid-1,x,x+w); // last row counted above...
+      int dn = white_in_row(mid,x,x+w);   // ...and below the middle
+      for (int d = 0; ms > 0 && (mid-d >= y+3 || mid+d < y+h-3) && (d <= window || mi == -1); d++){
+        for (int e = -1; e <= 1 && ms > 0; e += 2){
+          int i = mid+d*e;
+          if ((d == 0 && e == 1) || i < y+3 || i >= y+h-3){
+            continue;
+          }
+          int s = up+dn;
+          if (d > 0 && e < 0){
+            int r = white_in_row(i-1,x,x+w);
+            s = r+up; up = r;
+          }else if (d > 0){
+            int r = white_in_row(i,x,x+w);
+            s = dn+r; dn = r;
+          }
+          if (im[i*W+x] ||im[(i-1)*W+x] ||im[i*W+x+w-1] ||im[(i-1)*W+x+w-1]){
+            continue;
+          }
+          if (s < ms){
+            ms = s; mi = i;
           }
         }
       }
-      if (mi != -1){
-        polyline_t* it = frags;
-        while(it){
-          it->tail->x = mj;
-          it->tail->y = mi;
-          it = it->next;
+    }
+
+    if (w > params.chunk_size){ // same as above, try splitting left and right; wins a draw
+      int mid = x+w/2;
+      int mv = INT_MAX;
+      int up = white_in_col(mid-1,y,y+h);
+      int dn = white_in_col(mid,y,y+h);
+      for (int d = 0; mv > 0 && (mid-d >= x+3 || mid+d < x+w-3) && (d <= window || mj == -1); d++){
+        for (int e = -1; e <= 1 && mv > 0; e += 2){
+          int j = mid+d*e;
+          if ((d == 0 && e == 1) || j < x+3 || j >= x+w-3){
+            continue;
+          }
+          int s = up+dn;
+          if (d > 0 && e < 0){
+            int r = white_in_col(j-1,y,y+h);
+            s = r+up; up = r;
+          }else if (d > 0){
+            int r = white_in_col(j,y,y+h);
+            s = dn+r; dn = r;
+          }
+          if (im[W*y+j]||im[W*(y+h)-W+j]||im[W*y+j-1]||im[W*(y+h)-W+j-1]){
+            continue;
+          }
+          if (s < mv){
+            mv = s; mj = j;
+          }
         }
       }
+      if (mj != -1 && mv <= ms){
+        ms = mv;
+        mi = -1; // horizontal seam is defeated
+      }else{
+        mj = -1;
+      }
     }
-    return frags;
-  }
 
+    if (h > params.chunk_size && mi != -1){ // split top and bottom
+      L->x = x; L->y = y;  L->w = w; L->h = mi-y;
+      R->x = x; R->y = mi; R->w = w; R->h = y+h-mi;
+      *sx = mi;
+      return VERTICAL;
+    }else if (w > params.chunk_size && mj != -1){ // split left and right
+      L->x = x; L->y = y; L->w = mj-x; L->h = h;
+      R->x = mj;R->y = y; R->w = x+w-mj;R->h = h;
+      *sx = mj;
+      return HORIZONTAL;
+    }
+    return 0;
+  }
 
   /**Trace skeleton from thinning result.
    * Algorithm:
@@ -529,103 +2763,787 @@ struct skeleton_tracer_t {
    * @param w       width of  chunk
    * @param h       height of chunk
    * @param iter    current iteration
+   * @param rs      where to save the rects of sub-chunks, NULL for this->rects
    * @return        an array of polylines
   */
-  polyline_t* trace_skeleton(int x, int y, int w, int h, int iter){
+  polyline_t* trace_skeleton(int x, int y, int w, int h, int iter, _rects_t* rs = NULL){
     // printf("_%d %d %d %d %d\n",x,y,w,h,iter);
 
     polyline_t* frags = NULL;
+    if (!rs){
+      rs = &rects;
+    }
     
-    if (iter >= MAX_ITER){ // gameover
+    if (iter >= params.max_iter){ // gameover
       return frags;
     }
-    if (w <= CHUNK_SIZE && h <= CHUNK_SIZE){ // recursive bottom
+    if (is_leaf(x,y,w,h)){ // recursive bottom
       frags = chunk_to_frags(x,y,w,h);
       return frags;
     }
-   
-    int ms = INT_MAX; // number of white pixels on the seam, less the better
-    int mi = -1; // horizontal seam candidate
-    int mj = -1; // vertical   seam candidate
-    
-    if (h > CHUNK_SIZE){ // try splitting top and bottom
-      for (int i = y+3; i < y+h-3; i++){
-        if (im[i*W+x] ||im[(i-1)*W+x] ||im[i*W+x+w-1] ||im[(i-1)*W+x+w-1]){
-          continue;
-        }
-        int s = 0;
-        for (int j = x; j < x+w; j++){
-          s += im[i*W+j];
-          s += im[(i-1)*W+j];
+
+    rect_t L, R;
+    int sx;
+    int dr = split_chunk(x,y,w,h,&L,&R,&sx);
+
+    if (dr == 0){ // splitting failed! do the recursive bottom instead
+      return chunk_to_frags(x,y,w,h);
+    }
+    if (not_empty(L.x,L.y,L.w,L.h)){ // if there are no white pixels, don't waste time
+      add_rect_to(rs,L.x,L.y,L.w,L.h);
+      frags = trace_skeleton(L.x,L.y,L.w,L.h,iter+1,rs);
+    }
+    if (not_empty(R.x,R.y,R.w,R.h)){
+      add_rect_to(rs,R.x,R.y,R.w,R.h);
+      frags = merge_frags(frags, trace_skeleton(R.x,R.y,R.w,R.h,iter+1,rs),sx,dr);
+    }
+    if (iter == 0){
+      normalize_polylines(frags);
+    }
+    return frags;
+  }
+
+  /**set finished fragments aside: merge_impl() only matches ends lying on
+   * the first or last row or column of a chunk (the seam runs along one of
+   * them), so a fragment with neither end on the border of its chunk can't
+   * change any more, and needn't be scanned by the merges further up.
+   * One fragment always stays: merge_frag_lists() keeps the second list in
+   * order when the first is empty, but reverses it otherwise, so emptying a
+   * list would change which ends later merges pair up.
+   * @param frags  fragments of the chunk, the finished ones are taken out
+   * @param x      left of   chunk
+   * @param y      top of    chunk
+   * @param w      width of  chunk
+   * @param h      height of chunk
+   * @param done   finished fragments are prepended here
+   */
+  void emit_finished(frag_list_t* frags, int x, int y, int w, int h, frag_list_t* done){
+    polyline_t* it = frags->head;
+    while (it){
+      polyline_t* tmp = it->next;
+      int open = 0;
+      for (point_t* p = it->head; p; p = (p == it->tail) ? NULL : it->tail){
+        open |= p->x == x || p->x == x+w-1 || p->y == y || p->y == y+h-1;
+      }
+      if (!open && frags->size > 1){
+        remove_frag(frags,it);
+        push_frag(done,it);
+      }
+      it = tmp;
+    }
+  }
+
+  // pending step of trace_skeleton_iterative()
+  typedef struct _trace_item_t {
+    int x, y, w, h; // chunk
+    int dr;         // 0 = trace the chunk, HORIZONTAL/VERTICAL = merge the top two results
+    int sx;         // seam coordinate, for a merge
+    int save;       // add the chunk to the rects when it is traced
+  } trace_item_t;
+
+  /**trace_skeleton() without recursion: the chunks wait on an explicit work
+   * stack, and their fragments on a result stack until the post-order merge.
+   * Pushing (merge, second half, first half) visits chunks, saves rects and
+   * merges in the same order as trace_skeleton(), so the output is the same
+   * for any input that doesn't hit MAX_ITER there; this one has no depth cap.
+   * Memory: both stacks hold at most 2 entries per level of the chunk tree,
+   * and every split removes at least 3 rows or columns, so under w+h entries.
+   * With params.emit_finished the result of every merge goes through
+   * emit_finished(), which gives the same polylines in a different order.
+   *
+   * @param x       left of   chunk
+   * @param y       top of    chunk
+   * @param w       width of  chunk
+   * @param h       height of chunk
+   * @param rs      where to save the rects of sub-chunks, NULL for this->rects
+   * @param done    where to put finished polylines, NULL to append them to the result
+   * @return        an array of polylines
+   */
+  polyline_t* trace_skeleton_iterative(int x, int y, int w, int h, _rects_t* rs = NULL, frag_list_t* done = NULL){
+    if (!rs){
+      rs = &rects;
+    }
+    frag_list_t finished = {NULL,NULL,0};
+    frag_list_t none = {NULL,NULL,0};
+    int ncap = 64, nwork = 0, nres = 0;
+    trace_item_t* work = (trace_item_t*)malloc(sizeof(trace_item_t)*ncap);
+    frag_list_t* res = (frag_list_t*)malloc(sizeof(frag_list_t)*ncap);
+    trace_item_t top = {x,y,w,h,0,0,0};
+    work[nwork++] = top;
+
+    while (nwork){
+      trace_item_t it = work[--nwork];
+      if (nwork+3 > ncap || nres+1 > ncap){
+        ncap *= 2;
+        work = (trace_item_t*)realloc(work, sizeof(trace_item_t)*ncap);
+        res = (frag_list_t*)realloc(res, sizeof(frag_list_t)*ncap);
+      }
+      if (it.dr){ // both halves are done, merge them
+        nres--;
+        merge_frag_lists(&res[nres-1],&res[nres],it.sx,it.dr);
+        if (params.emit_finished){
+          emit_finished(&res[nres-1],it.x,it.y,it.w,it.h,&finished);
         }
-        if (s < ms){
-          ms = s; mi = i;
-        }else if (s == ms && abs(i-(y+h/2))<abs(mi-(y+h/2))){
-          // if there is a draw (very common), we want the seam to be near the middle
-          // to balance the divide and conquer tree
-          ms = s; mi = i;
+        continue;
+      }
+      if (it.save){
+        add_rect_to(rs,it.x,it.y,it.w,it.h);
+      }
+      if (is_leaf(it.x,it.y,it.w,it.h)){ // recursive bottom
+        res[nres++] = frag_list(chunk_to_frags(it.x,it.y,it.w,it.h));
+        continue;
+      }
+      rect_t L, R;
+      int sx;
+      int dr = split_chunk(it.x,it.y,it.w,it.h,&L,&R,&sx);
+      if (dr == 0){ // splitting failed! do the recursive bottom instead
+        res[nres++] = frag_list(chunk_to_frags(it.x,it.y,it.w,it.h));
+        continue;
+      }
+      int l = not_empty(L.x,L.y,L.w,L.h);
+      int r = not_empty(R.x,R.y,R.w,R.h);
+      if (!l && !r){
+        res[nres++] = none;
+        continue;
+      }
+      if (l && r){
+        trace_item_t m = {it.x,it.y,it.w,it.h,dr,sx,0};
+        work[nwork++] = m;
+      }
+      if (r){
+        trace_item_t c = {R.x,R.y,R.w,R.h,0,0,1};
+        work[nwork++] = c;
+      }
+      if (l){
+        trace_item_t c = {L.x,L.y,L.w,L.h,0,0,1};
+        work[nwork++] = c;
+      }
+    }
+    frag_list_t frags = res[0];
+    free(work);
+    free(res);
+    if (done){ // finished ones go in front of those already there
+      cat_frags(&finished,done);
+      *done = finished;
+      return frags.head;
+    }
+    cat_frags(&frags,&finished);
+    normalize_polylines(frags.head);
+    return frags.head;
+  }
+
+  // trace a chunk on the calling thread with the engine selected by TRACE_ITERATIVE
+  // (done: see trace_skeleton_iterative(), the recursive engine leaves finished polylines in the result)
+  polyline_t* trace_skeleton_serial(int x, int y, int w, int h, int iter, _rects_t* rs = NULL, frag_list_t* done = NULL){
+  #if TRACE_ITERATIVE
+    (void)iter; // no depth limit
+    return trace_skeleton_iterative(x,y,w,h,rs,done);
+  #else
+    return trace_skeleton(x,y,w,h,iter,rs);
+  #endif
+  }
+
+#if USE_THREADS
+  // second half of a chunk, queued for whichever worker gets to it first
+  struct trace_task_t {
+    int x, y, w, h, iter;
+    frag_list_t frags;       // result
+    _rects_t rects;          // rects saved while tracing it, in serial order
+    frag_list_t finished;    // polylines set aside by emit_finished()
+    std::atomic<bool> done;
+  };
+
+  struct task_pool_t {
+    std::vector<std::deque<trace_task_t*> > queues; // one per worker
+    std::vector<std::mutex> locks;
+    std::atomic<bool> stop;
+    std::mutex mtx;              // guards events, for sleeping on cv
+    std::condition_variable cv;  // notified when a task is pushed or finished, and on stop
+    long events;                 // count of those
+    task_pool_t(int n): queues(n), locks(n), stop(false), events(0) {}
+  };
+
+  // Work-stealing divide and conquer: every worker owns a deque of tasks,
+  // pushing and popping at the back. A chunk pushes its second half, traces
+  // the first half itself, then pops the second half back; if somebody
+  // stole it meanwhile, the worker runs other tasks until the thief is
+  // done. Idle workers steal from the front of other deques, where the
+  // oldest (largest) chunks are. Workers with nothing to do sleep until a
+  // task is pushed or finished. Each task keeps its own rect list, and
+  // they are joined in serial order, so the output is identical to
+  // trace_skeleton().
+
+  void pool_push(task_pool_t* pool, int wid, trace_task_t* t){
+    {
+      std::lock_guard<std::mutex> lock(pool->locks[wid]);
+      pool->queues[wid].push_back(t);
+    }
+    pool_signal(pool,false);
+  }
+
+  // count an event and wake one sleeping worker, or all of them
+  void pool_signal(task_pool_t* pool, bool all){
+    {
+      std::lock_guard<std::mutex> lock(pool->mtx);
+      pool->events++;
+    }
+    if (all){
+      pool->cv.notify_all();
+    }else{
+      pool->cv.notify_one();
+    }
+  }
+
+  // events so far; read it before looking for work, then pool_wait() on it
+  long pool_events(task_pool_t* pool){
+    std::lock_guard<std::mutex> lock(pool->mtx);
+    return pool->events;
+  }
+
+  // sleep until there was an event since pool_events() returned ev, or the pool stops
+  void pool_wait(task_pool_t* pool, long ev){
+    std::unique_lock<std::mutex> lock(pool->mtx);
+    pool->cv.wait(lock, [&]{ return pool->events != ev || pool->stop; });
+  }
+
+  // take t back from the own deque, false if it was stolen
+  bool pool_take(task_pool_t* pool, int wid, trace_task_t* t){
+    std::lock_guard<std::mutex> lock(pool->locks[wid]);
+    std::deque<trace_task_t*>& q = pool->queues[wid];
+    if (!q.empty() && q.back() == t){
+      q.pop_back();
+      return true;
+    }
+    return false;
+  }
+
+  // next task to run: own newest, or another worker's oldest
+  trace_task_t* pool_find(task_pool_t* pool, int wid){
+    int n = (int)pool->queues.size();
+    for (int k = 0; k < n; k++){
+      int v = (wid+k)%n;
+      std::lock_guard<std::mutex> lock(pool->locks[v]);
+      std::deque<trace_task_t*>& q = pool->queues[v];
+      if (!q.empty()){
+        trace_task_t* t;
+        if (k == 0){
+          t = q.back();
+          q.pop_back();
+        }else{
+          t = q.front();
+          q.pop_front();
         }
+        return t;
       }
     }
+    return NULL;
+  }
 
-    if (w > CHUNK_SIZE){ // same as above, try splitting left and right
-      for (int j = x+3; j < x+w-3; j++){
-        if (im[W*y+j]||im[W*(y+h)-W+j]||im[W*y+j-1]||im[W*(y+h)-W+j-1]){
-          continue;
+  void pool_run(task_pool_t* pool, int wid, trace_task_t* t){
+    t->frags = trace_skeleton_task(pool,wid,t->x,t->y,t->w,t->h,t->iter,&t->rects,&t->finished);
+    t->done = true;
+    pool_signal(pool,true); // whoever waits for t
+  }
+
+  // trace_skeleton() that hands second halves to the pool
+  frag_list_t trace_skeleton_task(task_pool_t* pool, int wid, int x, int y, int w, int h, int iter, _rects_t* rs, frag_list_t* done){
+    if (iter >= params.max_iter || w*h < PARALLEL_TRACE_MIN_PIXELS || (w <= params.chunk_size && h <= params.chunk_size)){
+      return frag_list(trace_skeleton_serial(x,y,w,h,iter,rs,done));
+    }
+    frag_list_t frags = {NULL,NULL,0};
+    rect_t L, R;
+    int sx;
+    int dr = params.split_policy == SPLIT_BALANCED ? split_chunk_balanced(x,y,w,h,&L,&R,&sx)
+                                                   : split_chunk(x,y,w,h,&L,&R,&sx);
+    if (dr == 0){
+      return frag_list(chunk_to_frags(x,y,w,h));
+    }
+    bool l = not_empty(L.x,L.y,L.w,L.h);
+    bool r = not_empty(R.x,R.y,R.w,R.h);
+    if (!l || !r){ // nothing to share
+      if (l){
+        add_rect_to(rs,L.x,L.y,L.w,L.h);
+        frags = trace_skeleton_task(pool,wid,L.x,L.y,L.w,L.h,iter+1,rs,done);
+      }else if (r){
+        add_rect_to(rs,R.x,R.y,R.w,R.h);
+        frags = trace_skeleton_task(pool,wid,R.x,R.y,R.w,R.h,iter+1,rs,done);
+      }
+      return frags;
+    }
+    trace_task_t t;
+    t.x = R.x; t.y = R.y; t.w = R.w; t.h = R.h; t.iter = iter+1;
+    t.frags = frags;
+    t.rects.head = NULL;
+    t.rects.tail = NULL;
+    t.finished = frags;
+    t.done = false;
+    pool_push(pool,wid,&t);
+
+    add_rect_to(rs,L.x,L.y,L.w,L.h);
+    frags = trace_skeleton_task(pool,wid,L.x,L.y,L.w,L.h,iter+1,rs,done);
+
+    if (pool_take(pool,wid,&t)){
+      pool_run(pool,wid,&t);
+    }
+    for (;;){ // stolen, help out meanwhile
+      long ev = pool_events(pool);
+      if (t.done){
+        break;
+      }
+      trace_task_t* o = pool_find(pool,wid);
+      if (o){
+        pool_run(pool,wid,o);
+      }else{
+        pool_wait(pool,ev);
+      }
+    }
+    add_rect_to(rs,R.x,R.y,R.w,R.h);
+    cat_rects(rs,&t.rects);
+    // same order as the serial engines: the second half's finished polylines come first
+    cat_frags(&t.finished,done);
+    *done = t.finished;
+    merge_frag_lists(&frags,&t.frags,sx,dr);
+    if (params.emit_finished){
+      emit_finished(&frags,x,y,w,h,done);
+    }
+    return frags;
+  }
+
+  /**trace_skeleton() on a work-stealing pool of nt threads (the caller included);
+   * produces the same polylines and rects
+   */
+  polyline_t* trace_skeleton_parallel(int x, int y, int w, int h, int nt){
+    task_pool_t pool(nt);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nt; t++){
+      workers.push_back(std::thread([&pool,this,t]{
+        for (;;){
+          long ev = pool_events(&pool);
+          if (pool.stop){
+            break;
+          }
+          trace_task_t* o = pool_find(&pool,t);
+          if (o){
+            pool_run(&pool,t,o);
+          }else{
+            pool_wait(&pool,ev);
+          }
         }
-        int s = 0;
-        for (int i = y; i < y+h; i++){
-          s += im[i*W+j]?1:0;
-          s += im[i*W+j-1]?1:0;
+      }));
+    }
+    frag_list_t done = {NULL,NULL,0};
+    frag_list_t frags = trace_skeleton_task(&pool,0,x,y,w,h,0,&rects,&done);
+    {
+      std::lock_guard<std::mutex> lock(pool.mtx);
+      pool.stop = true;
+    }
+    pool.cv.notify_all();
+    for (int t = 0; t < (int)workers.size(); t++){
+      workers[t].join();
+    }
+    cat_frags(&frags,&done);
+    normalize_polylines(frags.head);
+    return frags.head;
+  }
+#endif
+
+  // trace_skeleton() from the top, on num_threads threads when the region is large enough;
+  // the occupancy tables used by seam scores and emptiness tests are built once here
+  polyline_t* trace_skeleton_root(int x, int y, int w, int h){
+    polyline_t* frags;
+    build_occupancy(x,y,w,h);
+  #if LEAF_CACHE
+    init_leaf_cache();
+  #endif
+  #if USE_THREADS
+    int nt = thread_count();
+    if (nt > 1 && w*h >= PARALLEL_TRACE_MIN_PIXELS){
+      frags = trace_skeleton_parallel(x,y,w,h,nt);
+      destroy_occupancy();
+      return frags;
+    }
+  #endif
+    frags = trace_skeleton_serial(x,y,w,h,0);
+    destroy_occupancy();
+    return frags;
+  }
+
+  //================================
+  // GRAPH WALK
+  //================================
+
+  // Second tracing engine: follow the pixel graph of the skeleton directly.
+  // Pixels with other than 2 neighbours (ends and junctions) are the nodes,
+  // and every run of 2-neighbour pixels between two nodes is one polyline,
+  // walked once; loops with no node at all are walked last. Neighbours are
+  // m-adjacent (a diagonal only counts if neither pixel beside it is white),
+  // so the staircases Zhang-Suen leaves are plain paths, not triangles.
+  // The cost is a scan of the region (8 pixels at a time where blank) plus
+  // a few steps per white pixel, however the white pixels are spread out.
+
+  /**the m-adjacent white neighbours of a pixel inside a region
+   * @param i    row    of pixel
+   * @param j    column of pixel
+   * @param x    left of   region
+   * @param y    top of    region
+   * @param w    width of  region
+   * @param h    height of region
+   * @return     bit d set for a neighbour in direction d (0 = east, clockwise, see graph_step())
+   */
+  int graph_links(int i, int j, int x, int y, int w, int h){
+    int m = 0;
+    for (int d = 0; d < 8; d++){
+      int ni, nj;
+      graph_step(i,j,d,&ni,&nj);
+      if (ni >= y && ni < y+h && nj >= x && nj < x+w && im[ni*W+nj]){
+        m |= 1 << d;
+      }
+    }
+    for (int d = 1; d < 8; d += 2){ // diagonals beside a 4-neighbour are redundant
+      if ((m >> ((d+7)&7) & 1) || (m >> ((d+1)&7) & 1)){
+        m &= ~(1 << d);
+      }
+    }
+    return m;
+  }
+
+  // the pixel one step from (i,j) in direction d: 0 = east, 1 = south-east, ... 7 = north-east
+  static void graph_step(int i, int j, int d, int* ni, int* nj){
+    static const int di[8] = {0,1,1,1,0,-1,-1,-1};
+    static const int dj[8] = {1,1,0,-1,-1,-1,0,1};
+    *ni = i+di[d];
+    *nj = j+dj[d];
+  }
+
+  // the first white pixel of row from column j on (skipping blank pixels 32 at a time), or end
+  static int next_white(const uchar* row, int j, int end){
+    for (; j+32 <= end; j += 32){
+      uint64_t v[4];
+      memcpy(v,row+j,32);
+      if (v[0] | v[1] | v[2] | v[3]){
+        break;
+      }
+    }
+    while (j < end && !row[j]){
+      j++;
+    }
+    return j;
+  }
+
+  /**walk the pixel graph from (i,j) in direction d up to the next node, or
+   * back to (i,j) on a loop, marking the edges walked in both pixels
+   * @param seen   directions already walked, per pixel of the region
+   * @param passed incremented for every pixel walked through (not the ends)
+   * @return       the polyline, with a point every params.chunk_size pixels and at both ends
+   */
+  polyline_t* graph_walk(int i, int j, int d, int x, int y, int w, int h, uchar* seen, int* passed){
+    polyline_t* q = new_polyline();
+    add_point_to_polyline(q,j,i);
+    int i0 = i, j0 = j;
+    int step = std::max(params.chunk_size,1);
+    for (int n = 1; ; n++){
+      int ni, nj;
+      graph_step(i,j,d,&ni,&nj);
+      seen[(i-y)*w+j-x] |= 1 << d;
+      seen[(ni-y)*w+nj-x] |= 1 << ((d+4)&7);
+      i = ni;
+      j = nj;
+      int m = graph_links(i,j,x,y,w,h);
+      if (__builtin_popcount(m) != 2 || (i == i0 && j == j0)){
+        add_point_to_polyline(q,j,i);
+        return q;
+      }
+      (*passed)++;
+      if (n % step == 0){
+        add_point_to_polyline(q,j,i);
+      }
+      d = __builtin_ctz(m & ~(1 << ((d+4)&7))); // leave by the other neighbour
+    }
+  }
+
+  /**trace a region of the (thinned) image by walking its pixel graph
+   * instead of dividing and conquering. Polylines end at junctions (and
+   * isolated pixels are dropped, as trace_skeleton() drops them); no rects
+   * are saved.
+   * @param x    left of   region
+   * @param y    top of    region
+   * @param w    width of  region
+   * @param h    height of region
+   * @return     the polylines
+   */
+  polyline_t* trace_graph(int x, int y, int w, int h){
+    frag_list_t frags = {NULL,NULL,0};
+    uchar* seen = (uchar*)calloc(w*h, 1);
+    int links = 0;  // pixels with 2 neighbours
+    int passed = 0; // ... of which walked through from a node
+    for (int pass = 0; pass < 2; pass++){ // nodes first, then loops (if any are left)
+      if (pass == 1 && passed == links){
+        break;
+      }
+      for (int i = y; i < y+h; i++){
+        const uchar* row = im+i*W;
+        for (int j = next_white(row,x,x+w); j < x+w; j = next_white(row,j+1,x+w)){
+          int m = graph_links(i,j,x,y,w,h);
+          int k = __builtin_popcount(m);
+          if (pass == 0 && k == 2){
+            links++;
+          }
+          if (pass == 0 ? k == 2 : (k != 2 || seen[(i-y)*w+j-x])){
+            continue;
+          }
+          for (int d = 0; d < 8; d++){
+            if ((m >> d & 1) && !(seen[(i-y)*w+j-x] >> d & 1)){
+              push_frag(&frags,graph_walk(i,j,d,x,y,w,h,seen,&passed));
+            }
+          }
         }
-        if (s < ms){
-          ms = s;
-          mi = -1; // horizontal seam is defeated
-          mj = j;
-        }else if (s == ms && abs(j-(x+w/2))<abs(mj-(x+w/2))){
-          ms = s;
-          mi = -1;
-          mj = j;
+      }
+    }
+    free(seen);
+    return frags.head;
+  }
+
+  /**pick the tracing engine for a region with TRACE_AUTO. The graph walk
+   * does a fixed amount of work per polyline, and breaks polylines at every
+   * junction, so it loses on dense meshes and hatching, where nearly every
+   * pixel is a junction; elsewhere it is about twice as fast. White pixels
+   * and junctions are counted on TRACE_AUTO_SAMPLE_ROWS of the rows.
+   * @return     TRACE_GRAPH or TRACE_DIVIDE
+   */
+  int choose_engine(int x, int y, int w, int h){
+    long long white = 0, junctions = 0, area = 0;
+    int band = 16; // consecutive rows, so regular patterns aren't sampled at one phase
+    int stride = std::max(band,(int)((long long)h*band/TRACE_AUTO_SAMPLE_ROWS));
+    for (int i0 = y; i0 < y+h; i0 += stride){
+      for (int i = i0; i < std::min(i0+band,y+h); i++){
+        const uchar* row = im+i*W;
+        for (int j = next_white(row,x,x+w); j < x+w; j = next_white(row,j+1,x+w)){
+          white++;
+          junctions += __builtin_popcount(graph_links(i,j,x,y,w,h)) > 2;
         }
+        area += w;
       }
     }
+    if (white*100 < area*TRACE_AUTO_MAX_DENSITY && junctions*100 < white*TRACE_AUTO_MAX_JUNCTIONS){
+      return TRACE_GRAPH;
+    }
+    return TRACE_DIVIDE;
+  }
 
-    int L0=-1; int L1; int L2; int L3;
-    int R0=-1; int R1; int R2; int R3;
-    int dr = 0;
-    int sx;
-    if (h > CHUNK_SIZE && mi != -1){ // split top and bottom
-      L0 = x; L1 = y;  L2 = w; L3 = mi-y;
-      R0 = x; R1 = mi; R2 = w; R3 = y+h-mi;
-      dr = VERTICAL;
-      sx = mi;
-    }else if (w > CHUNK_SIZE && mj != -1){ // split left and right
-      L0 = x; L1 = y; L2 = mj-x; L3 = h;
-      R0 = mj;R1 = y; R2 =x+w-mj;R3 = h;
-      dr = HORIZONTAL;
-      sx = mj;
-    }
-
-    if (dr!=0 && not_empty(L0,L1,L2,L3)){ // if there are no white pixels, don't waste time
-      #if SAVE_RECTS
-        add_rect(L0,L1,L2,L3);
-      #endif
-      frags = trace_skeleton(L0,L1,L2,L3,iter+1);
+  // trace a region with the engine set in params.engine
+  polyline_t* trace_region(int x, int y, int w, int h){
+    int e = params.engine;
+    if (e == TRACE_AUTO){
+      e = choose_engine(x,y,w,h);
     }
-    if (dr!=0 && not_empty(R0,R1,R2,R3)){
-      #if SAVE_RECTS
-        add_rect(R0,R1,R2,R3);
-      #endif
-      frags = merge_frags(frags, trace_skeleton(R0,R1,R2,R3,iter+1),sx,dr);
+    last_engine = e;
+    if (e == TRACE_GRAPH){
+      return trace_graph(x,y,w,h);
     }
+    return trace_skeleton_root(x,y,w,h);
+  }
 
-    if (mi == -1 && mj == -1){ // splitting failed! do the recursive bottom instead
-      frags = chunk_to_frags(x,y,w,h);
+  //================================
+  // CONNECTED COMPONENTS
+  //================================
+
+  // root of a union-find tree, with path halving
+  static int uf_find(int* parent, int a){
+    while (parent[a] != a){
+      parent[a] = parent[parent[a]];
+      a = parent[a];
+    }
+    return a;
+  }
+
+  static void uf_union(int* parent, int a, int b){
+    a = uf_find(parent,a);
+    b = uf_find(parent,b);
+    if (a < b){
+      parent[b] = a;
+    }else if (b < a){
+      parent[a] = b;
+    }
+  }
+
+  /**label the 8-connected components of the image: one raster scan
+   * assigning provisional labels from the W, NW, N, NE neighbours and
+   * recording their equivalences in a union-find forest, then one scan
+   * resolving them
+   * @param lab  receives W*H labels, 0 for background, components numbered
+   *             1..n in raster order of their first pixel
+   * @param box  receives the bounding box of every component (box[0] unused)
+   * @return     number of components n
+   */
+  int label_components(int** lab, rect_t** box){
+    int* L = (int*)malloc(sizeof(int)*W*H);
+    int cap = 256, n = 1;
+    int* parent = (int*)malloc(sizeof(int)*cap);
+    parent[0] = 0;
+    for (int i = 0; i < H; i++){
+      for (int j = 0; j < W; j++){
+        int k = i*W+j;
+        L[k] = 0;
+        if (!im[k]){
+          continue;
+        }
+        int nb[4] = {
+          j > 0             ? L[k-1]   : 0,
+          i > 0 && j > 0    ? L[k-W-1] : 0,
+          i > 0             ? L[k-W]   : 0,
+          i > 0 && j < W-1  ? L[k-W+1] : 0,
+        };
+        for (int d = 0; d < 4; d++){
+          if (nb[d]){
+            if (!L[k]){
+              L[k] = nb[d];
+            }else{
+              uf_union(parent,L[k],nb[d]);
+            }
+          }
+        }
+        if (!L[k]){
+          if (n >= cap){
+            cap *= 2;
+            parent = (int*)realloc(parent, sizeof(int)*cap);
+          }
+          parent[n] = n;
+          L[k] = n++;
+        }
+      }
+    }
+    // number the sets in raster order of their first pixel
+    int* id = (int*)calloc(n, sizeof(int));
+    int m = 0;
+    rect_t* b = (rect_t*)malloc(sizeof(rect_t)*(n+1));
+    for (int k = 0; k < W*H; k++){
+      if (!L[k]){
+        continue;
+      }
+      int r = uf_find(parent,L[k]);
+      int i = k/W, j = k%W;
+      if (!id[r]){
+        id[r] = ++m;
+        rect_t e = {j,i,1,1,NULL};
+        b[m] = e;
+      }else{
+        rect_t e = {j,i,1,1,NULL};
+        b[id[r]] = rect_union(b[id[r]],e);
+      }
+      L[k] = id[r];
     }
+    free(id);
+    free(parent);
+    *lab = L;
+    *box = b;
+    return m;
+  }
 
+  /**trace one component in a tracer of its own, on a copy of its bounding
+   * box (plus a 1px margin) that holds only its pixels
+   * @param lab  labels from label_components()
+   * @param c    component id
+   * @param b    its bounding box
+   * @param nt   threads for the component's tracer
+   * @param rs   receives the margin box and the rects of sub-chunks, in image coordinates
+   * @return     polylines, in image coordinates
+   */
+  polyline_t* trace_component(int* lab, int c, rect_t b, int nt, _rects_t* rs){
+    skeleton_tracer_t T;
+    T.W = b.w+2;
+    T.H = b.h+2;
+    T.num_threads = nt;
+    T.params = params;
+    T.leaf_cache = leaf_cache; // shared
+    T.im = (uchar*)calloc(T.W*T.H, 1);
+    for (int i = 0; i < b.h; i++){
+      for (int j = 0; j < b.w; j++){
+        T.im[(i+1)*T.W+j+1] = lab[(b.y+i)*W+b.x+j] == c;
+      }
+    }
+    polyline_t* frags = T.trace_region(0,0,T.W,T.H);
+    int dx = b.x-1, dy = b.y-1;
+    for (polyline_t* it = frags; it; it = it->next){
+      for (point_t* jt = it->head; jt; jt = jt->next){
+        jt->x += dx;
+        jt->y += dy;
+      }
+    }
+    // the 1px margin lies outside the image for components on its border
+    rect_t box = {dx,dy,T.W,T.H,NULL};
+    box = rect_clip(box);
+    add_rect_to(rs,box.x,box.y,box.w,box.h);
+    for (rect_t* it = T.rects.head; it; it = it->next){
+      rect_t r = {it->x+dx,it->y+dy,it->w,it->h,NULL};
+      r = rect_clip(r);
+      it->x = r.x;
+      it->y = r.y;
+      it->w = r.w;
+      it->h = r.h;
+    }
+    cat_rects(rs,&T.rects);
+    T.leaf_cache = NULL;
+    T.destroy();
     return frags;
   }
 
+  /**trace every 8-connected component of the (thinned) image separately:
+   * seams are searched inside one component's box and fragments are only
+   * merged with fragments of the same component. Components are shared
+   * among num_threads threads (a single component uses them inside its own
+   * tracer instead). The seams differ from tracing the whole image, so the
+   * polylines can be split differently than by trace_skeleton_root().
+   * @return  polylines grouped by component, in component id order
+   *          (raster order of the components' first pixels)
+   */
+  polyline_t* trace_components(){
+    int* lab;
+    rect_t* box;
+    int n = label_components(&lab,&box);
+    num_components = n;
+  #if LEAF_CACHE
+    init_leaf_cache(); // before the threads start, they share it
+  #endif
+    polyline_t** frags = (polyline_t**)calloc(n+1, sizeof(polyline_t*));
+    _rects_t* crs = (_rects_t*)calloc(n+1, sizeof(_rects_t));
+    int nt = thread_count();
+    if (n == 1 || nt == 1){
+      for (int c = 1; c <= n; c++){
+        frags[c] = trace_component(lab,c,box[c],nt,&crs[c]);
+      }
+    }else{
+    #if USE_THREADS
+      std::atomic<int> next(1);
+      auto work = [&](){
+        int c;
+        while ((c = next++) <= n){
+          frags[c] = trace_component(lab,c,box[c],1,&crs[c]);
+        }
+      };
+      std::vector<std::thread> workers;
+      for (int t = 1; t < std::min(nt,n); t++){
+        workers.push_back(std::thread(work));
+      }
+      work();
+      for (int t = 0; t < (int)workers.size(); t++){
+        workers[t].join();
+      }
+    #endif
+    }
+    // concatenate in id order
+    frag_list_t all = {NULL,NULL,0};
+    for (int c = 1; c <= n; c++){
+      cat_rects(&rects,&crs[c]);
+      frag_list_t l = frag_list(frags[c]);
+      cat_frags(&all,&l);
+    }
+    free(frags);
+    free(crs);
+    free(box);
+    free(lab);
+    return all.head;
+  }
+
 
   //================================
   // GUI/IO
@@ -651,10 +3569,19 @@ struct skeleton_tracer_t {
     im = (uchar*)img;
 
     // print_bitmap();
-    thinning_zs();
+    thinning();
     // print_bitmap();
     
-    polyline_t* p = (polyline_t*)trace_skeleton(0,0,W,H,0);
+    #if TRACE_COMPONENTS
+      polyline_t* p = trace_components();
+    #else
+      rect_t bb = {0,0,W,H,NULL};
+      #if TRACE_CROP
+        // start from the content, with a 1px margin so strokes don't touch the chunk border
+        bb = rect_clip(rect_grow(foreground_bbox(),1));
+      #endif
+      polyline_t* p = bb.w > 0 ? trace_region(bb.x,bb.y,bb.w,bb.h) : NULL;
+    #endif
     std::string str = "POLYLINES:\n"+print_polylines(p)+"RECTS:\n"+print_rects();
     destroy_polylines(p);
 
@@ -671,6 +3598,9 @@ struct skeleton_tracer_t {
       free(im);
     }
     destroy_rects();
+  #if LEAF_CACHE
+    destroy_leaf_cache();
+  #endif
   }
 
 };